@@ -0,0 +1,97 @@
+/*
+
+ bench_parse.cpp - microbenchmarks for the input parsing in parse.cpp
+
+ Build and run:
+
+   make bench
+   ./bench_parse
+
+ Each case feeds the same input through SplitLines (and GetWord, as the
+ command processor would) over and over, in reads of up to 1000 bytes as
+ ProcessRead does, and reports the time per line.
+
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "parse.h"
+
+using namespace std;
+
+#define BENCH_LINES     200000    /* lines per timed run */
+#define BENCH_BYTES     20000000  /* or fewer, if they would make more input than this */
+#define BENCH_RUNS      5         /* best of this many runs is reported */
+#define READ_SIZE       1000      /* same as ProcessRead's buffer */
+
+/* stop the compiler optimising the work away */
+static volatile size_t iSink;
+
+static void CountLine (string & sLine, void * context)
+{
+  string word = GetWord (sLine);
+  iSink += word.length () + sLine.length ();
+  (*(long *) context)++;
+}	/* end of CountLine */
+
+static long long Nanoseconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}	/* end of Nanoseconds */
+
+/* time one case - "line" is repeated to make the input */
+
+static void Bench (const char * name, const string & line)
+{
+  /* enough repeats to make up BENCH_LINES lines */
+  long iPerLine = 0;
+  for (string::size_type i = 0; (i = line.find ('\n', i)) != string::npos; i++)
+    iPerLine++;
+  long iRepeats = BENCH_LINES / iPerLine;
+  if (iRepeats * line.length () > BENCH_BYTES)
+    iRepeats = BENCH_BYTES / line.length ();
+  string input;
+  for (long i = 0; i < iRepeats; i++)
+    input += line;
+
+  double fBest = 0;
+  for (int iRun = 0; iRun < BENCH_RUNS; iRun++)
+    {
+    string inbuf;
+    bool bSkipLine = false;
+    long iLines = 0;
+
+    long long iStart = Nanoseconds ();
+    for (string::size_type iDone = 0; iDone < input.length (); iDone += READ_SIZE)
+      {
+      inbuf.append (input, iDone, READ_SIZE);
+      SplitLines (inbuf, bSkipLine, CountLine, &iLines);
+      }
+    /* per line sent, whether or not it was thrown away */
+    double fPerLine = (double) (Nanoseconds () - iStart) / (iRepeats * iPerLine);
+
+    if (iRun == 0 || fPerLine < fBest)
+      fBest = fPerLine;
+    }
+
+  printf ("%-24s %8.1f ns/line  (%lu bytes per line)\n",
+          name, fBest, (unsigned long) (line.length () / iPerLine));
+}	/* end of Bench */
+
+int main (void)
+{
+  Bench ("typical", "say hello there, how are you?\n");
+  Bench ("short", "look\n");
+  Bench ("long line", "say " + string (2000, 'x') + "\n");
+  Bench ("too long (discarded)", "say " + string (MAX_INPUT_LINE * 2, 'x') + "\n");
+  Bench ("many spaces", string (200, ' ') + "say" + string (200, ' ') + "hello" + string (200, ' ') + "\n");
+  Bench ("CR/LF mix", "say hello\r\nlook\n\rtell bob hi\r\r\n");
+  Bench ("embedded NULs", string ("say he\0llo\0 there\0\n", 19));
+  Bench ("blank lines", "\n\n\n\n\n\n\n\n");
+  return 0;
+}	/* end of main */
@@ -0,0 +1,84 @@
+/*
+
+ fuzz_parse.cpp - libFuzzer entry point for the input parsing in parse.cpp
+
+ Build and run (needs clang):
+
+   make fuzz
+   ./fuzz_parse
+
+ The first byte of each input picks how big the reads are, the rest is what
+ the "player" sends. Every line SplitLines hands back, and every GetWord of
+ it, is checked against what it should look like - any mismatch aborts, which
+ libFuzzer reports as a crash along with the input that caused it.
+
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string>
+
+#include "parse.h"
+
+using namespace std;
+
+/* what must be true of every line we hand to the server */
+
+static void CheckLine (string & sLine, void * context)
+{
+  int * iLines = (int *) context;
+  (*iLines)++;
+
+  if (sLine.find_first_of (string ("\r\n\0", 3)) != string::npos)
+    abort ();   /* CR, LF or NUL got through */
+
+  if (!sLine.empty () && (sLine [0] == ' ' || sLine [sLine.length () - 1] == ' '))
+    abort ();   /* not trimmed */
+
+  /* GetWord should split at the first space, and trim what is left */
+  string::size_type iSpace = sLine.find (' ');
+  string expectword = sLine.substr (0, iSpace);
+  string expectrest = iSpace == string::npos ? "" : sLine.substr (iSpace + 1);
+  string::size_type iFirst = expectrest.find_first_not_of (' ');
+  expectrest.erase (0, iFirst == string::npos ? expectrest.length () : iFirst);
+
+  string rest = sLine;
+  string word = GetWord (rest);
+  if (word != expectword || rest != expectrest)
+    abort ();
+}	/* end of CheckLine */
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t * data, size_t size)
+{
+  if (size == 0)
+    return 0;
+
+  size_t iChunk = data [0] + 1;   /* 1 to 256 bytes per "read" */
+  data++;
+  size--;
+
+  string inbuf;
+  bool bSkipLine = false;
+  int iLines = 0;
+
+  for (size_t iDone = 0; iDone < size; iDone += iChunk)
+    {
+    size_t iLength = size - iDone < iChunk ? size - iDone : iChunk;
+    inbuf.append ((const char *) data + iDone, iLength);
+    SplitLines (inbuf, bSkipLine, CheckLine, &iLines);
+
+    /* a partial line can never grow past the limit */
+    if (inbuf.length () > MAX_INPUT_LINE || inbuf.find ('\n') != string::npos)
+      abort ();
+    }
+
+  /* Trim on its own - nothing but spaces at either end goes, nothing else does */
+  string s ((const char *) data, size);
+  string trimmed = s;
+  Trim (trimmed);
+  if (!trimmed.empty () && s.find (trimmed) == string::npos)
+    abort ();
+
+  return 0;
+}	/* end of LLVMFuzzerTestOneInput */
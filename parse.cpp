@@ -0,0 +1,117 @@
+/*
+
+ parse.cpp - input parsing for tinymudserver (see parse.h)
+
+ This program is placed in the public domain, like tinymudserver itself.
+
+*/
+
+#include <string>
+
+#include "parse.h"
+
+using namespace std;
+
+/* get rid of leading and trailing spaces from a string */
+
+void Trim (string & s)
+{
+  /* this is done to every line typed, so work in place rather than copying */
+  string::size_type iLastNonSpace = s.find_last_not_of (' ');
+  if (iLastNonSpace == string::npos)
+    s.erase ();  /* string only contains spaces, make it empty */
+  else
+    {
+    s.erase (iLastNonSpace + 1);
+    s.erase (0, s.find_first_not_of (' '));
+    }
+}	/* end of Trim */
+
+/* get rid of carriage-returns and NULs - clients send CR/LF (or worse), and a
+   NUL would cut a name or message short when it is printed */
+
+void StripControl (string & s)
+{
+  static const string sControl ("\r\0", 2);
+
+  string::size_type iTo = s.find_first_of (sControl);
+  if (iTo == string::npos)
+    return;		/* the usual case - nothing to do */
+
+  for (string::size_type iFrom = iTo; iFrom < s.length (); iFrom++)
+    if (s [iFrom] != '\r' && s [iFrom] != 0)
+      s [iTo++] = s [iFrom];
+
+  s.erase (iTo);
+}	/* end of StripControl */
+
+/* split a line into the first word, and rest-of-the-line */
+
+string GetWord (string & sLine)
+{
+  string word;
+
+  /* find space after first word */
+  string::size_type i = sLine.find (' ');
+
+  if (i == string::npos)
+    word.swap (sLine);		/* not found - whole input string is the word */
+  else
+    {
+    word.assign (sLine, 0, i);
+    sLine.erase (0, i + 1);	/* leave rest of line */
+    }
+
+  /* trim both the found word, and the rest of the line */
+  Trim (word);
+  Trim (sLine);
+
+  /* return first word in line */
+  return word;
+
+}	/* end of GetWord */
+
+/* Take each complete line out of inbuf, strip CRs and NULs and surrounding
+   spaces from it, and pass it to handler. Whatever follows the last newline
+   is left in inbuf for next time - unless it is longer than MAX_INPUT_LINE,
+   in which case it is thrown away, and so is the rest of it when it arrives
+   (bSkipLine remembers that, between calls). Returns true if a line was
+   thrown away just now, so the caller can complain. */
+
+bool SplitLines (string & inbuf, bool & bSkipLine,
+                 tLineHandler handler, void * context)
+{
+  /* we step through the buffer, and only remove what we used once, at the end */
+  string::size_type iStart = 0;
+  for ( ; ; )
+    {
+    string::size_type i = inbuf.find ('\n', iStart);
+    if (i == string::npos)
+      break;	/* no more at present */
+
+    string sLine (inbuf, iStart, i - iStart);	/* extract next line */
+    iStart = i + 1;
+
+    /* the end of a line that was too long - ignore it */
+    if (bSkipLine)
+      {
+      bSkipLine = false;
+      continue;
+      }
+
+    StripControl (sLine);
+    Trim (sLine);	/* get rid of leading, trailing spaces */
+    handler (sLine, context);  /* now, do something with it */
+    }
+
+  inbuf.erase (0, iStart);		/* keep any partial line for next time */
+
+  /* don't let someone use up all our memory by never sending a newline */
+  if (inbuf.length () <= MAX_INPUT_LINE)
+    return false;
+
+  inbuf.erase ();
+  bool bNew = !bSkipLine;
+  bSkipLine = true;		/* throw away the rest of it when it arrives */
+  return bNew;
+}	/* end of SplitLines */
@@ -0,0 +1,36 @@
+/*
+
+ parse.h - input parsing for tinymudserver
+
+ Everything a player types goes through these, so they are kept apart from
+ the server (no players, sockets or messages here) where they can be
+ fuzzed (fuzz_parse.cpp) and timed (bench_parse.cpp) on their own.
+
+*/
+
+#ifndef TINYMUDSERVER_PARSE_H
+#define TINYMUDSERVER_PARSE_H
+
+#include <string>
+
+/* longest line we will accept from a player - anything longer is thrown away */
+
+#define MAX_INPUT_LINE      4096
+
+/* get rid of leading and trailing spaces from a string */
+void Trim (std::string & s);
+
+/* get rid of carriage-returns and NULs */
+void StripControl (std::string & s);
+
+/* split a line into the first word (returned), and rest-of-the-line (left in sLine) */
+std::string GetWord (std::string & sLine);
+
+/* called by SplitLines with each complete line, cleaned up */
+typedef void (* tLineHandler) (std::string & sLine, void * context);
+
+/* take the complete lines out of an input buffer - see parse.cpp */
+bool SplitLines (std::string & inbuf, bool & bSkipLine,
+                 tLineHandler handler, void * context);
+
+#endif /* TINYMUDSERVER_PARSE_H */
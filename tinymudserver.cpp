@@ -32,7 +32,7 @@
 
  To compile without using the makefile:
 
-   gcc tinymudserver.cpp -o tinymudserver -g -Wall
+   g++ tinymudserver.cpp parse.cpp -o tinymudserver -g -O2 -Wall -lpthread
  
 */
 
@@ -44,19 +44,36 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdint.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/errno.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 /* stl includes for string handling and lists */
 
 #include <string>
 #include <list>
+#include <map>
+#include <set>
+#include <memory>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#include "parse.h"		/* Trim, GetWord etc. - see parse.cpp */
 
 #define UMIN(a, b)              ((a) < (b) ? (a) : (b))
 #define UMAX(a, b)              ((a) > (b) ? (a) : (b))
@@ -70,6 +87,7 @@ using namespace std;			/* some stl operations will fail if we don't do this */
 /* change this stuff to customise behaviour (eg. connection port) */
 
 #define PORT 							4000								/* port to connect to */
+#define WEB_PORT          4001                /* port for web browsers (WebSocket) */
 
 /* every MESSAGE_INTERVAL seconds the message TICK_MESSAGE is sent to all connected players */
 
@@ -80,6 +98,82 @@ using namespace std;			/* some stl operations will fail if we don't do this */
 #define COMMS_WAIT_SEC  	0    								/* time to wait in seconds */
 #define COMMS_WAIT_USEC 	500000    					/* time to wait in microseconds */
 
+/* Output to players. Everything queued for a player is sent with one writev
+   (up to MAX_IOV strings at a time), and sockets have Nagle's algorithm turned
+   off so that goes straight out. When there is at least CORK_BYTES to send
+   (eg. a long listing), the socket is corked while we write so it leaves in
+   full-sized packets. Set CORK_BYTES to 0 to never cork. */
+
+#define MAX_IOV             64
+#define CORK_BYTES          4096
+
+/* WebSocket connections (on WEB_PORT) */
+
+#define MAX_HTTP_REQUEST    8192    /* longest upgrade request we will wait for */
+#define WEBSOCKET_GUID      "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"  /* from RFC 6455 */
+
+/* session recording */
+
+#define TRACE_MAGIC         "TMT1"    /* first 4 bytes of a trace file */
+#define REPLAY_GRACE_USEC   2000000   /* how long the replayer waits for output at the end */
+
+/* Sharded mode (run as "tinymudserver -s <shards>"). The original process keeps
+   the listening socket and becomes a router - it hands each new connection to
+   one of the shard processes, and relays tells and broadcasts between them over
+   Unix domain sockets (the "message bus"). */
+
+#define MAX_SHARDS        16        /* most shard processes we will fork */
+#define BUS_READ_SIZE     8192      /* bytes read from the message bus at one time */
+
+/* Persistence. Commands that change the world are appended to a journal, and
+   the journal is written and flushed to disk once per pass of the main loop.
+   Every so often a forked child writes a snapshot of the world, after which the
+   older journals are removed. At startup we load the snapshot and replay any
+   journals written since. */
+
+#define JOURNAL_FILE        "world.journal"   /* journals are this, plus .<generation> */
+#define SNAPSHOT_FILE       "world.snapshot"
+#define SNAPSHOT_MAGIC      "TMS1"            /* first 4 bytes of a snapshot */
+#define SNAPSHOT_INTERVAL   300     /* seconds between snapshots */
+#define SNAPSHOT_RECORDS    10000   /* snapshot early after this many journal records,
+                                       this bounds how long recovery can take */
+
+/* chat channels */
+
+#define ADMIN_NAME          "Admin"   /* player who may use the admin channel */
+#define ADMIN_PASSWORD_ENV  "TINYMUD_ADMIN_PASSWORD"  /* their password - nobody can be Admin without it */
+#define CHANNEL_HISTORY     20        /* messages kept for people who join a channel late */
+#define MAX_CHANNELS        100       /* most channels that can exist at once */
+#define MAX_CHANNEL_NAME    20        /* longest channel name */
+
+/* Creatures (NPCs). Every NPC_TICK_USEC microseconds each creature decides
+   what to do, wanders between NPC_ROOMS rooms, and regains or loses hit points.
+   Players are all in room 0. With NPC_THREAD_MIN or more creatures the work is
+   split between NPC_THREADS threads. A tick taking longer than NPC_TICK_BUDGET
+   microseconds is counted as an overrun (see the "creatures" command). */
+
+#define NPC_COUNT           1000      /* creatures to start with - change with -n */
+#define MAX_NPCS            1000000
+#define NPC_ROOMS           1000
+#define NPC_TICK_USEC       500000
+#define NPC_TICK_BUDGET     50000
+#define NPC_THREADS         4
+#define NPC_THREAD_MIN      20000
+
+/* Memory. Everything allocated with "new" (which includes strings and STL
+   containers) is counted against the connection it was allocated for, and which
+   part of the server it is used by - the admin "memory" command shows this.
+   Once more than MEMORY_SOFT_PERCENT of MEMORY_BUDGET is in use, player chatter
+   ("say" and channels) is dropped - notices like "has left" still go. Over the budget, the connection using the most memory
+   is disconnected (one per pass of the main loop) - as long as connections are
+   what is using it, or that one is using more than MEMORY_SHED_FLOOR. */
+
+#define MEMORY_BUDGET       (256LL * 1024 * 1024)   /* bytes - change with -m <megabytes> */
+#define MEMORY_SOFT_PERCENT 80
+#define MAX_MEMORY_ACCOUNTS 1024      /* connections counted separately, the rest are "server" */
+#define MEMORY_TOP          10        /* how many connections "memory" lists */
+#define MEMORY_SHED_FLOOR   (1024LL * 1024)   /* a connection using more than this is always fair game */
+
 /* messages sent to the player - customise these or translate into other languages */
 
 #define INITIAL_STRING 			"\nWelcome to the Tiny MUD Server version " VERSION "\n"  
@@ -103,6 +197,113 @@ using namespace std;			/* some stl operations will fail if we don't do this */
 #define HUH								  "Huh?\n"
 #define TICK_MESSAGE		    "You hear creepy noises ...\n"
 #define SHUTDOWN            "\n\n** Game closed by system operator\n\n"
+#define PLAYER_JOINED       "Player %s has joined the game.\n"
+#define PLAYER_LEFT         "Player %s has left the game.\n"
+#define PASSWORD_WHAT       "Change your password to what?\n"
+#define PASSWORD_CHANGED    "Password changed.\n"
+#define PASSWORD_NOT_SAVED  "Sorry, passwords can't be changed on a sharded server - nothing would be saved.\n"
+#define ADMIN_DISABLED      "Nobody can be %s - the server was started without an admin password.\n"
+#define ADMIN_PASSWORD_FIXED "The admin password is set when the server is started.\n"
+#define CHANNEL_WHICH       "Which channel?\n"
+#define CHANNEL_BAD_NAME    "Channel names are letters and digits, up to %i of them.\n"
+#define CHANNEL_TOO_MANY    "There are too many channels already.\n"
+#define CHANNEL_NOT_ALLOWED "You are not allowed on the %s channel.\n"
+#define CHANNEL_JOINED      "You join the %s channel.\n"
+#define CHANNEL_LEFT        "You leave the %s channel.\n"
+#define CHANNEL_NOT_ON      "You are not on the %s channel.\n"
+#define CHANNEL_ALREADY_ON  "You are already on the %s channel.\n"
+#define CHANNEL_CHAT_WHAT   "Chat what on the %s channel?\n"
+#define CHANNEL_MESSAGE     "[%s] %s: %s\n"
+#define CHANNEL_LIST        "Channels (* = you are on it):"
+#define INPUT_TOO_LONG      "Input lines cannot be longer than %i characters.\n"
+#define OUTPUT_STATS        "You have been sent %lli bytes in %lli writes (%lli bytes per write).\n"
+#define LANGUAGE_LIST       "Languages (* = the one you are using):"
+#define LANGUAGE_UNKNOWN    "There are no messages for language %s.\n"
+#define LANGUAGE_CHOSEN     "You will now see messages in %s.\n"
+#define MEMORY_TOTAL        "%lli bytes in use (peak %lli), budget %lli bytes, %lli messages dropped.\n"
+#define MEMORY_ACCOUNT      "  %-20s %12lli bytes:%s\n"
+#define CREATURES_HERE      "Creatures lurking here: %i.\n"
+#define CREATURE_STATS      "%i creatures in %i rooms, using %i threads.\n" \
+                            "%lli ticks: last %lli us, average %lli us, worst %lli us, " \
+                            "%lli over the %i us budget.\n"
+
+/* Every message above (except CHANNEL_MESSAGE, whose text is kept in the channel
+   history and shared by every subscriber) is looked up by number, so that it
+   can be replaced by a message catalog - see LoadCatalog. The defines are the
+   default text for any message a catalog doesn't have. */
+
+#define MESSAGES \
+  MESSAGE (INITIAL_STRING) \
+  MESSAGE (FINAL_STRING) \
+  MESSAGE (TELL_NAME) \
+  MESSAGE (ALREADY_CONNECTED) \
+  MESSAGE (TELL_PASSWORD) \
+  MESSAGE (PASSWORD_INCORRECT) \
+  MESSAGE (WELCOME) \
+  MESSAGE (LOOK_STRING) \
+  MESSAGE (IN_THE_ROOM) \
+  MESSAGE (SAY_WHAT) \
+  MESSAGE (YOU_SAY) \
+  MESSAGE (SOMEONE_SAYS) \
+  MESSAGE (TELL_WHOM) \
+  MESSAGE (TELL_WHAT) \
+  MESSAGE (NOT_SELF) \
+  MESSAGE (YOU_TELL) \
+  MESSAGE (SOMEONE_TELLS) \
+  MESSAGE (NOT_CONNECTED) \
+  MESSAGE (HUH) \
+  MESSAGE (TICK_MESSAGE) \
+  MESSAGE (SHUTDOWN) \
+  MESSAGE (PLAYER_JOINED) \
+  MESSAGE (PLAYER_LEFT) \
+  MESSAGE (PASSWORD_WHAT) \
+  MESSAGE (PASSWORD_CHANGED) \
+  MESSAGE (CHANNEL_WHICH) \
+  MESSAGE (CHANNEL_BAD_NAME) \
+  MESSAGE (CHANNEL_TOO_MANY) \
+  MESSAGE (CHANNEL_NOT_ALLOWED) \
+  MESSAGE (CHANNEL_JOINED) \
+  MESSAGE (CHANNEL_LEFT) \
+  MESSAGE (CHANNEL_NOT_ON) \
+  MESSAGE (CHANNEL_ALREADY_ON) \
+  MESSAGE (CHANNEL_CHAT_WHAT) \
+  MESSAGE (CHANNEL_LIST) \
+  MESSAGE (INPUT_TOO_LONG) \
+  MESSAGE (OUTPUT_STATS) \
+  MESSAGE (LANGUAGE_LIST) \
+  MESSAGE (LANGUAGE_UNKNOWN) \
+  MESSAGE (LANGUAGE_CHOSEN) \
+  MESSAGE (CREATURES_HERE) \
+  MESSAGE (CREATURE_STATS) \
+  MESSAGE (MEMORY_TOTAL) \
+  MESSAGE (MEMORY_ACCOUNT) \
+  MESSAGE (PASSWORD_NOT_SAVED) \
+  MESSAGE (ADMIN_DISABLED) \
+  MESSAGE (ADMIN_PASSWORD_FIXED)
+
+/* message numbers - M_INITIAL_STRING and so on */
+enum
+{
+#define MESSAGE(name) M_##name,
+  MESSAGES
+#undef MESSAGE
+  eMessageCount
+};
+
+/* Message catalogs. The catalog for language xx is the file messages.xx.cat,
+   made from a text file by "tinymudserver -c <text file> <catalog>" (use
+   "tinymudserver -d" to get a text file of the default messages to start from).
+   Catalogs are mapped into memory when first used, and mapped again on SIGHUP
+   to pick up changes without a restart. Replace a catalog by writing a new file
+   and renaming it over the old one - changing the mapped file in place could
+   crash the server. */
+
+#define DEFAULT_LANGUAGE    "en"          /* language new players get */
+#define CATALOG_PREFIX      "messages."
+#define CATALOG_SUFFIX      ".cat"
+#define CATALOG_MAGIC       "TMC1"        /* first 4 bytes of a catalog */
+#define MAX_LANGUAGES       20            /* most languages loaded at once */
+#define MAX_LANGUAGE_NAME   10            /* longest language code */
 
 /* We use -1 to indicate no socket is connected */
 
@@ -112,8 +313,14 @@ static int bStopNow = 0;			/* set by signal handler */
 
 time_t tLastMessage;							/* time we last sent a periodic message */
 
-/* socket for accepting new connections */
+/* sockets for accepting new connections */
 static int iControl = NO_SOCKET;
+static int iWebControl = NO_SOCKET;   /* WebSocket connections */
+
+/* sharded mode - these stay at NO_SOCKET unless we are a shard process */
+static int iShard = -1;           /* which shard we are, -1 if not sharded */
+static int iBus = NO_SOCKET;      /* stream socket to the router, carries batched frames */
+static int iHandoff = NO_SOCKET;  /* datagram socket new connections arrive on */
 
 /* converts a string to const char * */
 #define str(arg) arg.c_str ()
@@ -121,6 +328,13 @@ static int iControl = NO_SOCKET;
 typedef list<string> tStringList;
 typedef tStringList::iterator tStringIterator;
 
+/* Output text. A message sent to many players (eg. by SendToAll or a channel)
+   is allocated once, and every player's output list refers to the same copy. */
+typedef shared_ptr<const string> tText;
+typedef list<tText> tTextList;
+
+class tChannel;
+
 /* connection states - add more to have more complex connection dialogs */
 enum
 {
@@ -129,6 +343,225 @@ enum
   ePlaying,			/* this is the normal 'connected' mode  */
 };
 
+/* what the player's client speaks */
+enum
+{
+  eTelnet,							/* plain text, a line at a time */
+  eWebSocketHandshake,	/* browser - waiting for its HTTP upgrade request */
+  eWebSocket,						/* browser - text arrives in WebSocket frames */
+};
+
+/*---------------------------------------------- */
+/*  language class - the messages for one language, shared by everyone using it */
+/*---------------------------------------------- */
+
+class tLanguage
+{
+public:
+  string code;				/* eg. "en" */
+  const void * pMap;	/* the catalog, mapped into memory (NULL if none) */
+  size_t iMapSize;		/* how big the mapping is */
+  const char * text [eMessageCount];		/* each message - in the catalog, or the default */
+  bool bPlain [eMessageCount];				/* message has no % in it, so needs no formatting */
+
+  tLanguage ()	/* constructor */
+    {
+    pMap = NULL;
+    iMapSize = 0;
+    };
+};
+
+/* the languages loaded so far - the first is DEFAULT_LANGUAGE */
+tLanguage languages [MAX_LANGUAGES];
+int iLanguages = 0;
+
+/* set by SIGHUP - map the catalogs again */
+static int bReloadMessages = 0;
+
+/*---------------------------------------------- */
+/*  memory accounting */
+/*---------------------------------------------- */
+
+/* what the memory is used for */
+
+enum
+{
+  eMemOther,
+  eMemPlayer,       /* tPlayer, and what commands allocate for them */
+  eMemInput,
+  eMemOutput,
+  eMemChannels,
+  eMemWorld,
+  eMemCreatures,
+  eMemSubsystems
+};
+
+const char * memorysubsystems [eMemSubsystems] =
+  { "other", "player", "input", "output", "channels", "world", "creatures" };
+
+/* Account 0 is the server itself, the others are given to connections. When
+   a connection goes, what it still has is moved to the server, and the account
+   gets a new generation so that freeing those blocks later is charged correctly.
+   This has no constructor, so it is ready before any static object uses "new". */
+
+struct tMemoryAccount
+  {
+  long long iBytes [eMemSubsystems];
+  unsigned int iGeneration;
+  bool bInUse;
+  };
+
+tMemoryAccount memoryaccounts [MAX_MEMORY_ACCOUNTS];
+
+long long iMemoryInUse = 0;
+long long iMemoryPeak = 0;
+long long iMemoryBudget = MEMORY_BUDGET;
+long long iMessagesDropped = 0;     /* because we were short of memory */
+bool bMemoryShort = false;          /* over the soft limit - drop player chatter */
+bool bServerOverBudget = false;     /* over the budget, but not because of the connections */
+
+/* who new allocations are charged to - each thread has its own */
+static __thread int iMemoryAccount = 0;
+static __thread int iMemorySubsystem = eMemOther;
+
+/* put in front of each block, keeping what follows 16-byte aligned */
+
+struct tMemoryHeader
+  {
+  size_t iSize;
+  unsigned int iGeneration;
+  unsigned short iAccount;
+  unsigned short iSubsystem;
+  };
+
+void * operator new (size_t iSize)
+{
+  tMemoryHeader * h = (tMemoryHeader *) malloc (sizeof (tMemoryHeader) + iSize);
+  if (!h)
+    throw bad_alloc ();
+
+  h->iSize = iSize;
+  h->iAccount = iMemoryAccount;
+  h->iSubsystem = iMemorySubsystem;
+  h->iGeneration = memoryaccounts [iMemoryAccount].iGeneration;
+
+  __sync_fetch_and_add (&memoryaccounts [h->iAccount].iBytes [h->iSubsystem], (long long) iSize);
+  long long iTotal = __sync_add_and_fetch (&iMemoryInUse, (long long) iSize);
+  if (iTotal > iMemoryPeak)
+    iMemoryPeak = iTotal;   /* near enough if two threads race */
+
+  return h + 1;
+}	/* end of operator new */
+
+void * operator new (size_t iSize, const nothrow_t &) noexcept
+{
+  try
+    {
+    return operator new (iSize);
+    }
+  catch (...)
+    {
+    return NULL;
+    }
+}	/* end of operator new (nothrow) */
+
+void operator delete (void * ptr) noexcept
+{
+  if (!ptr)
+    return;
+
+  tMemoryHeader * h = (tMemoryHeader *) ptr - 1;
+
+  /* the connection it was for has gone, so the server has it now */
+  int iAccount = h->iAccount;
+  if (h->iGeneration != memoryaccounts [iAccount].iGeneration)
+    iAccount = 0;
+
+  __sync_fetch_and_sub (&memoryaccounts [iAccount].iBytes [h->iSubsystem], (long long) h->iSize);
+  __sync_fetch_and_sub (&iMemoryInUse, (long long) h->iSize);
+  free (h);
+}	/* end of operator delete */
+
+void operator delete (void * ptr, size_t) noexcept
+{
+  operator delete (ptr);
+}	/* end of operator delete (sized) */
+
+void operator delete (void * ptr, const nothrow_t &) noexcept
+{
+  operator delete (ptr);
+}	/* end of operator delete (nothrow) */
+
+/* charge allocations to an account and subsystem until this goes out of scope */
+
+class tMemoryOwner
+{
+  int iOldAccount;
+  int iOldSubsystem;
+
+public:
+  tMemoryOwner (const int iAccount, const int iSubsystem)
+    {
+    iOldAccount = iMemoryAccount;
+    iOldSubsystem = iMemorySubsystem;
+    iMemoryAccount = iAccount;
+    iMemorySubsystem = iSubsystem;
+    };
+
+  ~tMemoryOwner ()
+    {
+    iMemoryAccount = iOldAccount;
+    iMemorySubsystem = iOldSubsystem;
+    };
+};
+
+/* an account for a new connection - the server's (0) if they are all taken */
+
+int NewMemoryAccount (void)
+{
+  static int iNext = 1;
+
+  for (int i = 1; i < MAX_MEMORY_ACCOUNTS; i++, iNext++)
+    {
+    if (iNext >= MAX_MEMORY_ACCOUNTS)
+      iNext = 1;
+    if (!memoryaccounts [iNext].bInUse)
+      {
+      memoryaccounts [iNext].bInUse = true;
+      return iNext++;
+      }
+    }
+
+  return 0;
+}	/* end of NewMemoryAccount */
+
+/* a connection has gone - the server takes over whatever it still has */
+
+void ReleaseMemoryAccount (const int iAccount)
+{
+  if (iAccount == 0)
+    return;
+
+  tMemoryAccount & account = memoryaccounts [iAccount];
+  account.iGeneration++;
+  for (int i = 0; i < eMemSubsystems; i++)
+    {
+    long long iBytes = __sync_fetch_and_and (&account.iBytes [i], 0LL);
+    __sync_fetch_and_add (&memoryaccounts [0].iBytes [i], iBytes);
+    }
+  account.bInUse = false;
+}	/* end of ReleaseMemoryAccount */
+
+/* everything charged to an account */
+
+long long MemoryAccountTotal (const int iAccount)
+{
+  long long iTotal = 0;
+  for (int i = 0; i < eMemSubsystems; i++)
+    iTotal += memoryaccounts [iAccount].iBytes [i];
+  return iTotal;
+}	/* end of MemoryAccountTotal */
+
 /*---------------------------------------------- */
 /*  player class - holds details about each connected player */
 /*---------------------------------------------- */
@@ -140,23 +573,47 @@ public:
   int connstate;			/* connection state */
   string playername;	/* player name */
 
-  tStringList outbuf;	/* pending output */
+  tTextList outbuf;		/* pending output */
+  string::size_type iOutSent;	/* how much of the first item in outbuf has been sent */
   string inbuf;				/* pending input */
+  bool bSkipLine;			/* discarding the rest of a line that was too long */
   string address;			/* address player is from */
   int port; 					/* port they connected on */
+  bool bAdmin;				/* may use admin commands and channels */
+  int iLanguage;			/* which of the languages they see messages in */
+  int protocol;				/* eTelnet, eWebSocket etc. */
+  long long iConnection;	/* unique number for this connection, for session traces */
+  string wsbuf;				/* WebSocket - partial frame received */
+  int iFramed;				/* WebSocket - items at the front of outbuf already in a frame */
+  long long iSends;		/* number of writes to their socket */
+  long long iBytesSent;	/* bytes those writes sent */
+  set<tChannel *> channels;	/* channels they are listening to */
+  int iAccount;				/* memory account their allocations are charged to */
 
   tPlayer ()	/* constructor */
     {
     s = NO_SOCKET;						/* no socket yet */
     connstate = eAwaitingName;	/* new player needs name */
     port = 0;
+    iOutSent = 0;
+    bSkipLine = false;
+    bAdmin = false;
+    iLanguage = 0;
+    protocol = eTelnet;
+    iFramed = 0;
+    iConnection = 0;
+    iSends = 0;
+    iBytesSent = 0;
+    iAccount = 0;
     };
   
   ~tPlayer ()	/* destructor */
     {
-    printf ("Deleting player, socket %i\n", s);
+    printf ("Deleting player, socket %i (%lli bytes sent in %lli writes)\n",
+            s, iBytesSent, iSends);
     if (s != NO_SOCKET)	/* close connection if active */
       close (s);
+    ReleaseMemoryAccount (iAccount);
     };
 };
 
@@ -167,24 +624,73 @@ typedef tPlayerList::iterator tPlayerListIterator;
 /* here is the actual list */
 tPlayerList playerlist;		/* list of all connected players */
 
-/* a couple of forward declaration */
-void ProcessWrite (tPlayer * p);
-void DoLook (tPlayer * p);
+/* in sharded mode, the names of players who are playing on other shards */
+set<string> remoteplayers;
 
-/* get rid of leading and trailing spaces from a string */
+/* from the environment at startup - empty if there isn't one */
+string sAdminPassword;
+
+/*---------------------------------------------- */
+/*  channel class - a named group of players who hear each other's chat */
+/*---------------------------------------------- */
 
-void Trim (string & s)
+class tChannel
 {
-  string::size_type iPastSpace = s.find_first_not_of (' ');
-  if (iPastSpace == string::npos)
-    s = "";  /* string only contains spaces, make it empty */
-  else
+public:
+  string name;				/* channel name */
+  bool bAdmin;				/* only admins may join */
+  bool bPermanent;		/* built-in channel, as opposed to one a player made up */
+  set<tPlayer *> subscribers;	/* who is listening */
+
+  /* the last few messages, in a ring - once it is full, each new message
+     replaces the oldest one */
+  tText history [CHANNEL_HISTORY];
+  int iHistoryNext;		/* where the next message goes */
+  int iHistoryCount;	/* how many are in use */
+
+  tChannel ()	/* constructor */
     {
-    string::size_type iLastNonSpace = s.find_last_not_of (' ');
-    string::size_type iLength = iLastNonSpace - iPastSpace + 1;
-    s = s.substr (iPastSpace, iLength);
-    }
-}
+    bAdmin = false;
+    bPermanent = false;
+    iHistoryNext = 0;
+    iHistoryCount = 0;
+    };
+};
+
+typedef map<string, tChannel> tChannelMap;
+typedef tChannelMap::iterator tChannelMapIterator;
+
+/* all channels, by name */
+tChannelMap channels;
+
+/*---------------------------------------------- */
+/*  player record - the part of a player that persists between sessions */
+/*---------------------------------------------- */
+
+class tPlayerRecord
+{
+public:
+  string password;		/* in practice you would store a hash of it */
+  int iLogins;				/* how many times they have connected */
+  time_t tLastOn;			/* when they last connected */
+
+  tPlayerRecord ()	/* constructor */
+    {
+    iLogins = 0;
+    tLastOn = 0;
+    };
+};
+
+typedef map<string, tPlayerRecord> tPlayerRecordMap;
+typedef tPlayerRecordMap::iterator tPlayerRecordIterator;
+
+/* every player who has ever connected, by name */
+tPlayerRecordMap playerrecords;
+
+/* a couple of forward declaration */
+void ProcessWrite (tPlayer * p);
+void DoLook (tPlayer * p);
+void WebSocketControl (tPlayer * p, const int iOpcode, const string & payload);
 
 /* find a player by name */
 
@@ -204,22 +710,24 @@ tPlayer * FindPlayer (const char * name)
 
 /* set up comms - get ready to listen for connection */
 
-int InitComms (void)
+int Listen (const int iPort)
   {
   struct sockaddr_in sa;
+  int s;
 
   /* Create the control socket */
-  if ( (iControl = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+  if ( (s = socket (AF_INET, SOCK_STREAM, 0)) == -1)
     {
     perror ("creating control socket");
-    return 1;
+    return NO_SOCKET;
     }
   
   /* make sure socket doesn't block */
-  if (fcntl( iControl, F_SETFL, FNDELAY ) == -1)
+  if (fcntl( s, F_SETFL, FNDELAY ) == -1)
     {
     perror ("fcntl on control socket");
-    return 1;
+    close (s);
+    return NO_SOCKET;
     }
 
   struct linger	ld;
@@ -227,32 +735,49 @@ int InitComms (void)
   ld.l_linger = 0;
 
   /* Don't allow closed sockets to linger */
-  if (setsockopt( iControl, SOL_SOCKET, SO_LINGER,
+  if (setsockopt( s, SOL_SOCKET, SO_LINGER,
                   (char *) &ld, sizeof ld ) == -1)
     {
     perror ("setsockopt");
-    return 1;
+    close (s);
+    return NO_SOCKET;
     }
   
   sa.sin_family       = AF_INET;
-  sa.sin_port	        = htons (PORT);
+  sa.sin_port	        = htons (iPort);
   sa.sin_addr.s_addr  = INADDR_ANY;		/* change to listen on a specific adapter */
 
   /* bind the socket to our connection port */
-  if ( bind (iControl, (struct sockaddr *) &sa, sizeof sa) == -1)
+  if ( bind (s, (struct sockaddr *) &sa, sizeof sa) == -1)
     {
     perror ("bind");
-    return 1;
+    close (s);
+    return NO_SOCKET;
     }
   
   /* wait for connections */
 
-  if (listen (iControl, 3) == -1)
+  if (listen (s, 3) == -1)
     {
     perror ("listen");
-    return 1;
+    close (s);
+    return NO_SOCKET;
     }
 
+  return s;
+  }   /* end of Listen */
+
+int InitComms (void)
+  {
+  /* telnet (the usual MUD client) on one port, web browsers on the other */
+  iControl = Listen (PORT);
+  if (iControl == NO_SOCKET)
+    return 1;
+
+  iWebControl = Listen (WEB_PORT);
+  if (iWebControl == NO_SOCKET)
+    return 1;
+
   tLastMessage = time (NULL);
   
   return 0;
@@ -266,593 +791,4014 @@ void CloseComms (void)
 
   fprintf (stderr, "Closing all comms connections.\n");
 
-  /* close listening socket */
+  /* close listening sockets */
   if (iControl != NO_SOCKET)
     close (iControl);
   iControl = NO_SOCKET;
- 
+  if (iWebControl != NO_SOCKET)
+    close (iWebControl);
+  iWebControl = NO_SOCKET;
+
   } /* end of CloseComms */
 
-/* SendBuffer - used for sending printf style strings */
+/*---------------------------------------------- */
+/*  message bus - used between shards in sharded mode */
+/*---------------------------------------------- */
 
-char SendBuffer [1000];
+/* Each frame on the bus is a 4-byte length (covering the type and body), a
+   1-byte type, then the body. Strings in the body are a 2-byte length followed
+   by the characters. Frames are appended to an output buffer as they are
+   generated, and the whole buffer goes out in one write per pass of the main
+   loop, so a busy tick costs one system call rather than one per message.
+   Both ends are on the same machine, so we use host byte order throughout. */
 
-void Send (tPlayer * p, const char * message, ...)
+enum
 {
-  if (p->s == NO_SOCKET)
-    return;
-
-  va_list ap;
-  va_start (ap, message);
-  int iSent = vsnprintf (SendBuffer, (sizeof SendBuffer) - 1, message, ap);
-  va_end (ap);
+  eBusJoin = 1,       /* name - player started playing on the sending shard (announce it) */
+  eBusLeave,          /* name - player left the sending shard (announce it) */
+  eBusBroadcast,      /* message number, 2 arguments - send to every playing player */
+  eBusTell,           /* from, to, text - deliver a tell */
+  eBusTellOk,         /* from, to, text - tell was delivered */
+  eBusTellFailed,     /* from, to, text - tell could not be delivered */
+  eBusChannel,        /* channel, text - publish on a channel */
+  eBusJoinRefused,    /* name - from the router, the name is in use on another shard */
+};
 
-  if (iSent == -1)
-    {
-    fprintf (stderr, "Message too long to be sent to player %i\n", p->s);
-    return;
-    }
+/* append a length-prefixed string to a frame body (also used for the journal and snapshots) */
 
-  p->outbuf.push_back (SendBuffer);
-}	/* end of Send */
+void PutString (string & body, const string & s)
+{
+  unsigned short iLength = UMIN (s.length (), 0xFFFF);
+  body.append ((const char *) &iLength, sizeof iLength);
+  body.append (s, 0, iLength);
+}	/* end of PutString */
 
-/* send message to all connected players, excepting "ExceptThis" (which can be null) */
+/* extract a length-prefixed string from a frame body, false if malformed */
 
-void SendToAll (tPlayer * ExceptThis, const char * message, ...)
+bool GetString (const string & body, string::size_type & pos, string & s)
 {
+  unsigned short iLength;
+  if (pos + sizeof iLength > body.length ())
+    return false;
+  memcpy (&iLength, body.data () + pos, sizeof iLength);
+  pos += sizeof iLength;
+  if (pos + iLength > body.length ())
+    return false;
+  s = body.substr (pos, iLength);
+  pos += iLength;
+  return true;
+}	/* end of GetString */
+
+/* append a number to a frame body */
+
+void PutNumber (string & body, const long long iNumber)
+{
+  body.append ((const char *) &iNumber, sizeof iNumber);
+}	/* end of PutNumber */
 
-  va_list ap;
-  va_start (ap, message);
-  int iSent = vsnprintf (SendBuffer, (sizeof SendBuffer) - 1, message, ap);
-  va_end (ap);
-
-  if (iSent == -1)
-    {
-    fprintf (stderr, "Message too long to be sent to all players\n");
-    return;
-    }
+/* extract a number from a frame body, false if malformed */
 
-  for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
-    {
-    tPlayer * p = *listiter;
+bool GetNumber (const string & body, string::size_type & pos, long long & iNumber)
+{
+  if (pos + sizeof iNumber > body.length ())
+    return false;
+  memcpy (&iNumber, body.data () + pos, sizeof iNumber);
+  pos += sizeof iNumber;
+  return true;
+}	/* end of GetNumber */
 
-    if (p != ExceptThis &&					/* ignore this player */
-        p->s != NO_SOCKET &&				/* don't if not connected */
-        p->connstate == ePlaying)		/* only send if playing (eg. entered name etc.) */
-      p->outbuf.push_back (SendBuffer);
-    
-    }
-}	/* end of SendToAll */
+/* add a frame to an output buffer - it is not sent until BusWrite */
 
-void ClosePlayer (tPlayer * p)
+void BusQueue (string & outbuf, const int iType, const string & body)
 {
-  /* close comms connection */
-  if (p->s != NO_SOCKET)
-    close (p->s);
-  p->s = NO_SOCKET;
-}	/* end of ClosePlayer */
+  unsigned int iLength = body.length () + 1;
+  unsigned char cType = iType;
+  outbuf.append ((const char *) &iLength, sizeof iLength);
+  outbuf.append ((const char *) &cType, sizeof cType);
+  outbuf += body;
+}	/* end of BusQueue */
 
-void ProcessPlayerName (string & sLine, tPlayer * p)
+/* take the next complete frame from an input buffer, false if there isn't one */
+
+bool BusNextFrame (string & inbuf, int & iType, string & body)
 {
-  /* name can't be blank */
-  if (sLine.empty ())
-    {
-    Send (p, TELL_NAME);
-    return;
-    }
+  unsigned int iLength;
+  if (inbuf.length () < sizeof iLength)
+    return false;
+  memcpy (&iLength, inbuf.data (), sizeof iLength);
+  if (iLength == 0 || inbuf.length () < sizeof iLength + iLength)
+    return false;
+  iType = (unsigned char) inbuf [sizeof iLength];
+  body = inbuf.substr (sizeof iLength + 1, iLength - 1);
+  inbuf.erase (0, sizeof iLength + iLength);
+  return true;
+}	/* end of BusNextFrame */
+
+/* read whatever is waiting on a bus socket, returns false if the other end has gone */
+
+bool BusRead (const int s, string & inbuf)
+{
+  static char buf [BUS_READ_SIZE];
 
-  /* don't allow two of the same name */
-  if (FindPlayer (str (sLine)))
+  for ( ; ; )
     {
-    Send (p, ALREADY_CONNECTED, str (sLine));
-    Send (p, TELL_NAME);
-    return;
+    int nRead = read (s, buf, sizeof buf);
+
+    if (nRead == 0)
+      return false;
+
+    if (nRead == -1)
+      {
+      if (errno == EWOULDBLOCK || errno == EINTR)
+        return true;
+      perror ("read from message bus");
+      return false;
+      }
+
+    inbuf.append (buf, nRead);
     }
-  
-  /* in practice you would look up the player name on disk */
-  /* you might also allow for 'new' to allow new players to be created */
-  
-  p->playername = sLine;
-  p->connstate = eAwaitingPassword;
-  Send (p, TELL_PASSWORD);
-  
-}	/* end of ProcessPlayerName */
+}	/* end of BusRead */
 
-void ProcessPlayerPassword (string & sLine, tPlayer * p)
+/* write out as much of the bus output buffer as we can, returns false on error */
+
+bool BusWrite (const int s, string & outbuf)
 {
-  /* password can't be blank */
-  if (sLine.empty ())
+  while (!outbuf.empty ())
     {
-    Send (p, TELL_PASSWORD);
-    return;
+    int nWrite = write (s, outbuf.data (), outbuf.length ());
+    if (nWrite < 0)
+      {
+      if (errno == EWOULDBLOCK || errno == EINTR)
+        return true;
+      perror ("write to message bus");
+      return false;
+      }
+    outbuf.erase (0, nWrite);
     }
+  return true;
+}	/* end of BusWrite */
 
-  /* for testing I am just looking for the same password as the name */
+/* a new connection being passed from the router to a shard - the socket
+   itself goes with it, as SCM_RIGHTS ancillary data */
 
-  /* in practice, you would store the password in the player file  */
-  
-  if (sLine != p->playername)
-    {
-    Send (p, PASSWORD_INCORRECT);
-    Send (p, TELL_PASSWORD);
-    return;
-    }
-  
-  p->connstate = ePlaying;
-  Send (p, WELCOME, str (p->playername));
-  DoLook (p);		/* new player looks around */
-  SendToAll (p, "Player %s has joined the game.\n", str (p->playername));
-  /* log on console */
-  printf ("Player %s has joined the game.\n", str (p->playername));
+struct tHandoff
+{
+  struct sockaddr_in sa;	/* where it came from */
+  int iProtocol;					/* eTelnet, eWebSocketHandshake */
+};
 
-}	/* end of ProcessPlayerPassword */
+/* pending bus traffic for this shard */
+string sBusIn;
+string sBusOut;
 
-/* split a line into the first word, and rest-of-the-line */
+/* queue a frame from this shard to the router (does nothing if not sharded) */
 
-string GetWord (string & sLine)
+void BusSend (const int iType, const string & s1,
+              const string & s2 = "", const string & s3 = "")
 {
-  string word = sLine;
-    
-  /* find space after first word */
-  string::size_type i = sLine.find (' ');
-  
-  if (i == string::npos)
-    sLine = "";			/* not found - whole input string is the word */
-  else
-    {
-    word = sLine.substr (0, i);
-    sLine = sLine.substr (i + 1, string::npos);	/* get rest of line */
-    }
+  if (iBus == NO_SOCKET)
+    return;
 
-  /* trim both the found word, and the rest of the line */
-  Trim (word);
-  Trim (sLine);
+  string body;
+  PutString (body, s1);
+  PutString (body, s2);
+  PutString (body, s3);
+  BusQueue (sBusOut, iType, body);
+}	/* end of BusSend */
 
-  /* return first word in line */
-  return word;
-  
-}	/* end of GetWord */
+/*---------------------------------------------- */
+/*  journal and snapshots */
+/*---------------------------------------------- */
 
-/* quit */
+/* journal record types - each record is a frame as on the message bus, with a
+   body of: player name, argument */
 
-void DoQuit (tPlayer * p)
-  {
-  /* if s/he finished connecting, tell others s/he has left */
-  
-  if (p->connstate == ePlaying)
-    {
-    Send (p, FINAL_STRING);
-    ProcessWrite (p);		/* force message out */
-    printf ("Player %s has left the game.\n", str (p->playername));
-    SendToAll (p, "Player %s has left the game.\n", str (p->playername));   
-    }	/* end of properly connected */
+enum
+{
+  eJournalLogin = 1,    /* name, time they connected */
+  eJournalPassword,     /* name, new password */
+};
 
-  ClosePlayer (p);
-  }	/* end of DoQuit */
+static int iJournal = NO_SOCKET;    /* journal file, NO_SOCKET if not persisting */
+string sJournalOut;                 /* records not yet written to the journal */
+long long iGeneration = 0;          /* which journal we are appending to */
+int iJournalRecords = 0;            /* records since the last snapshot */
+time_t tLastSnapshot;               /* time we last started a snapshot */
+static pid_t iSnapshotPid = 0;      /* child writing a snapshot, 0 if none */
+long long iSnapshotGeneration = 0;  /* first journal not covered by that snapshot */
 
-/* look */
+/* name of the journal file for a generation */
 
-void DoLook (tPlayer * p)
+string JournalName (const long long iGen)
 {
-  Send (p, LOOK_STRING);
+  char buf [100];
+  snprintf (buf, sizeof buf, "%s.%lld", JOURNAL_FILE, iGen);
+  return buf;
+}	/* end of JournalName */
 
-  /* list other players in the same room */
-  /* in practice we would check the room number to be the same as ours */
-  
-  int iOthers = 0;
-  for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+/* read a whole file into a string, false if it can't be opened */
+
+bool ReadFile (const string & name, string & contents)
+{
+  int fd = open (str (name), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  char buf [8192];
+  int nRead;
+  contents.erase ();
+  while ((nRead = read (fd, buf, sizeof buf)) > 0)
+    contents.append (buf, nRead);
+
+  close (fd);
+  return nRead == 0;
+}	/* end of ReadFile */
+
+/* make a journal record take effect on the world */
+
+void ApplyJournal (const int iType, const string & name, const string & arg)
+{
+  tMemoryOwner owner (0, eMemWorld);
+  tPlayerRecord & record = playerrecords [name];
+
+  switch (iType)
     {
-    tPlayer *otherp = *listiter;
-    if (otherp != p &&	/* we don't see ourselves */
-        otherp->connstate == ePlaying &&  /* must be connected */
-        otherp->s != NO_SOCKET)  /* and not about to leave  */
+    case eJournalLogin:
+      if (record.password.empty ())
+        record.password = name;		/* for testing, a new player's password is their name */
+      record.iLogins++;
+      record.tLastOn = atol (str (arg));
+      break;
+
+    case eJournalPassword:
+      record.password = arg;
+      break;
+
+    default:
+      fprintf (stderr, "Unknown journal record type %i\n", iType);
+      break;
+    }
+}	/* end of ApplyJournal */
+
+/* change the world, and remember that we did so it survives a crash */
+
+void Journal (const int iType, const string & name, const string & arg)
+{
+  ApplyJournal (iType, name, arg);
+
+  string body;
+  PutString (body, name);
+  PutString (body, arg);
+  BusQueue (sJournalOut, iType, body);
+  iJournalRecords++;
+}	/* end of Journal */
+
+/* Group commit - everything journalled since last time goes out in one write
+   and one fsync. This is called once per pass of the main loop, after reading
+   players' commands and before writing any output those commands caused (and
+   before the few places that write output straight away, like DoQuit). If the
+   write or the fdatasync fails, it is tried again next time - what was not
+   written is kept, and what was written is synced again. Returns false if
+   anything is still waiting to go to disk. */
+
+bool bJournalFailing = false;   /* so we complain once, not every pass */
+bool bJournalNeedsSync = false; /* written, but not yet known to be on disk */
+
+bool JournalFlush (void)
+{
+  if (iJournal == NO_SOCKET)
+    {
+    sJournalOut.erase ();	/* not persisting (eg. sharded) */
+    return true;
+    }
+
+  if (sJournalOut.empty () && !bJournalNeedsSync)
+    return true;
+
+  string::size_type iDone = 0;
+  bool bOk = true;
+  while (iDone < sJournalOut.length ())
+    {
+    int nWrite = write (iJournal, sJournalOut.data () + iDone, sJournalOut.length () - iDone);
+    if (nWrite < 0)
       {
-      if (iOthers++ == 0)
-        Send (p, IN_THE_ROOM);
-      else
-        Send (p, ", ");
-      Send (p, str (otherp->playername));
+      if (errno == EINTR)
+        continue;
+      if (!bJournalFailing)
+        perror ("**** write to journal - changes are NOT being saved, will retry");
+      bOk = false;
+      break;
       }
-    }		/* end of looping through all players */
+    iDone += nWrite;
+    bJournalNeedsSync = true;
+    }
 
-  /* If we listed anyone, finish up the line with a period, newline */
-  if (iOthers)
-    Send (p, ".\n");
+  if (bJournalNeedsSync)
+    {
+    if (fdatasync (iJournal) == 0)
+      bJournalNeedsSync = false;
+    else
+      {
+      if (!bJournalFailing)
+        perror ("**** fdatasync on journal - changes may NOT be saved, will retry");
+      bOk = false;
+      }
+    }
 
-}	/* end of DoLook */
+  /* keep whatever did not get written */
+  sJournalOut.erase (0, iDone);
 
-/* say <something> */
+  if (bOk && bJournalFailing)
+    fprintf (stderr, "Journal writes are working again\n");
+  bJournalFailing = !bOk;
 
-void DoSay (tPlayer * p, string sWhat)
+  return bOk && sJournalOut.empty () && !bJournalNeedsSync;
+}	/* end of JournalFlush */
+
+/* start appending to the journal for a generation */
+
+bool OpenJournal (const long long iGen)
 {
-  if (sWhat.empty ())
-    Send (p, SAY_WHAT);
-  else
+  iJournal = open (str (JournalName (iGen)), O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (iJournal == -1)
     {
-    Send (p, YOU_SAY, str (sWhat));
-    SendToAll (p, SOMEONE_SAYS, str (p->playername), str (sWhat));
+    perror ("opening journal");
+    iJournal = NO_SOCKET;
+    return false;
     }
-}	/* end of DoSay */
+  iGeneration = iGen;
+  return true;
+}	/* end of OpenJournal */
 
-/* tell <someone> <something> */
+/* write a snapshot of the world - this runs in the forked child */
 
-void DoTell (tPlayer * p, string sWhat)
+bool WriteSnapshot (const long long iGen)
 {
-  /* error if nothing after 'tell' */
-  if (sWhat.empty ())
+  string buf = SNAPSHOT_MAGIC;
+  PutNumber (buf, iGen);
+  PutNumber (buf, playerrecords.size ());
+
+  for (tPlayerRecordIterator recorditer = playerrecords.begin (); recorditer != playerrecords.end (); recorditer++)
     {
-    Send (p, TELL_WHOM);
-    return;    
+    PutString (buf, recorditer->first);
+    PutString (buf, recorditer->second.password);
+    PutNumber (buf, recorditer->second.iLogins);
+    PutNumber (buf, recorditer->second.tLastOn);
     }
 
-  /* next word is who to tell it to */
+  /* write to a temporary file, and only replace the old snapshot once it is all on disk */
+  string tempname = SNAPSHOT_FILE ".tmp";
+  int fd = open (str (tempname), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    {
+    perror ("creating snapshot");
+    return false;
+    }
 
-  string who = GetWord (sWhat);
+  string::size_type iDone = 0;
+  while (iDone < buf.length ())
+    {
+    int nWrite = write (fd, buf.data () + iDone, buf.length () - iDone);
+    if (nWrite < 0)
+      {
+      perror ("write to snapshot");
+      close (fd);
+      return false;
+      }
+    iDone += nWrite;
+    }
 
-  if (sWhat.empty ())
+  if (fsync (fd) == -1 || close (fd) == -1)
+    {
+    perror ("closing snapshot");
+    return false;
+    }
+
+  if (rename (str (tempname), SNAPSHOT_FILE) == -1)
+    {
+    perror ("renaming snapshot");
+    return false;
+    }
+
+  return true;
+}	/* end of WriteSnapshot */
+
+/* Start a snapshot. We switch to a new journal, then fork - the child has a
+   copy-on-write image of the world as at the end of the old journal, and
+   writes it out while we carry on. */
+
+void StartSnapshot (void)
+{
+  if (iJournal == NO_SOCKET || iSnapshotPid)
+    return;
+
+  /* the new journal must only have changes made after the snapshot */
+  if (!JournalFlush ())
+    return;
+
+  int iOldJournal = iJournal;
+  long long iOldGeneration = iGeneration;
+
+  if (!OpenJournal (iGeneration + 1))
     {
-    Send (p, TELL_WHAT, str (who));
+    /* carry on with the journal we had - try again later */
+    iJournal = iOldJournal;
+    iGeneration = iOldGeneration;
+    tLastSnapshot = time (NULL);
+    fprintf (stderr, "**** Could not start journal %lli - still using journal %lli, no snapshot\n",
+             iOldGeneration + 1, iOldGeneration);
     return;
     }
 
-  /* scan player list to find a player of this name */
-  
-  tPlayer * ptarget = FindPlayer (str (who));
+  close (iOldJournal);
 
-  if (!ptarget)
+  fflush (stdout);
+  fflush (stderr);
+
+  pid_t pid = fork ();
+
+  if (pid == -1)
     {
-    Send (p, NOT_CONNECTED, str (who));
+    perror ("fork for snapshot");
     return;
     }
 
-  if (p == ptarget)
+  if (pid == 0)
+    _exit (WriteSnapshot (iGeneration) ? 0 : 1);
+
+  iSnapshotPid = pid;
+  iSnapshotGeneration = iGeneration;
+  iJournalRecords = 0;
+  tLastSnapshot = time (NULL);
+}	/* end of StartSnapshot */
+
+/* see if the snapshot child has finished - if it worked, the journals it covers can go */
+
+void CheckSnapshot (void)
+{
+  if (!iSnapshotPid)
+    return;
+
+  int iStatus;
+  pid_t pid = waitpid (iSnapshotPid, &iStatus, WNOHANG);
+
+  if (pid == 0)
+    return;		/* still going */
+
+  iSnapshotPid = 0;
+
+  if (pid == -1 || !WIFEXITED (iStatus) || WEXITSTATUS (iStatus) != 0)
     {
-    Send (p, NOT_SELF);
+    fprintf (stderr, "Snapshot failed, keeping journals\n");
     return;
     }
-  
-  Send (p, YOU_TELL, str (who), str (sWhat));
-  Send (ptarget, SOMEONE_TELLS, str (p->playername), str (sWhat));
-  
-}	/* end of DoTell */
 
-/* process commands when player is connected */
+  for (long long iGen = iSnapshotGeneration - 1; iGen >= 0; iGen--)
+    if (unlink (str (JournalName (iGen))) == -1)
+      break;		/* earlier ones went last time */
 
-void ProcessCommand (string & sLine, tPlayer * p)
+}	/* end of CheckSnapshot */
+
+/* called each pass of the main loop */
+
+void PeriodicSave (void)
 {
-  
-  string command = GetWord (sLine);
+  JournalFlush ();
+  CheckSnapshot ();
 
-  if (command == "quit")
-    DoQuit (p);
-  else if (command == "look")
-    DoLook (p);
-  else if (command == "say")
-    DoSay (p, sLine);
-  else if (command == "tell")
-    DoTell (p, sLine);
-  else
-    Send (p, HUH);
-  
-}	/* end of ProcessCommand */
+  if (iJournalRecords >= SNAPSHOT_RECORDS ||
+      (iJournalRecords > 0 && time (NULL) > tLastSnapshot + SNAPSHOT_INTERVAL))
+    StartSnapshot ();
+}	/* end of PeriodicSave */
 
-/* process player input - check connection state, and act accordingly */
+/* load the snapshot, returns the first journal generation it does not cover */
 
-void ProcessPlayerInput (string & sLine, tPlayer * p)
+long long LoadSnapshot (void)
 {
+  string buf;
+  if (!ReadFile (SNAPSHOT_FILE, buf))
+    return 0;		/* no snapshot yet */
 
-  /* get rid of carriage-return, if present */
+  string::size_type pos = strlen (SNAPSHOT_MAGIC);
+  long long iGen, iCount;
 
-  string::size_type i = sLine.find ('\r');
-  if (i != string::npos)
-    sLine.erase (i, 1);
-  
-  switch (p->connstate)
+  if (buf.compare (0, pos, SNAPSHOT_MAGIC) != 0 ||
+      !GetNumber (buf, pos, iGen) ||
+      !GetNumber (buf, pos, iCount))
     {
-    /* until we have name and password we must prompt them */
-    case eAwaitingName:
-      ProcessPlayerName (sLine, p);
-      break;
-      
-    case eAwaitingPassword:
-      ProcessPlayerPassword (sLine, p);
+    fprintf (stderr, "Snapshot %s is not valid, ignoring it\n", SNAPSHOT_FILE);
+    return 0;
+    }
+
+  for (long long i = 0; i < iCount; i++)
+    {
+    string name;
+    tPlayerRecord record;
+    long long iLogins, tLastOn;
+
+    if (!GetString (buf, pos, name) ||
+        !GetString (buf, pos, record.password) ||
+        !GetNumber (buf, pos, iLogins) ||
+        !GetNumber (buf, pos, tLastOn))
+      {
+      fprintf (stderr, "Snapshot %s is truncated\n", SNAPSHOT_FILE);
       break;
+      }
 
-    /* if playing, everything they type is a command of some sort */
-    case ePlaying:
-      ProcessCommand (sLine, p);
+    record.iLogins = iLogins;
+    record.tLastOn = tLastOn;
+    playerrecords [name] = record;
+    }
+
+  return iGen;
+}	/* end of LoadSnapshot */
+
+/* replay one journal, returns false if there isn't one. A record that was only
+   partly written when we crashed is cut off the end. */
+
+bool ReplayJournal (const long long iGen, int & iRecords)
+{
+  string name = JournalName (iGen);
+  string buf;
+
+  if (!ReadFile (name, buf))
+    return false;
+
+  string::size_type iSize = buf.length ();
+  int iType;
+  string body;
+
+  while (BusNextFrame (buf, iType, body))
+    {
+    string::size_type pos = 0;
+    string who, arg;
+    if (GetString (body, pos, who) && GetString (body, pos, arg))
+      ApplyJournal (iType, who, arg);
+    iRecords++;
+    }
+
+  if (!buf.empty ())
+    {
+    fprintf (stderr, "Discarding %i bytes of incomplete record from %s\n",
+             (int) buf.length (), str (name));
+    if (truncate (str (name), iSize - buf.length ()) == -1)
+      perror ("truncating journal");
+    }
+
+  return true;
+}	/* end of ReplayJournal */
+
+/* rebuild the world from the snapshot and journals, then carry on journalling */
+
+int RecoverWorld (void)
+{
+  tMemoryOwner owner (0, eMemWorld);
+  struct timeval tStart, tEnd;
+  gettimeofday (&tStart, NULL);
+
+  long long iGen = LoadSnapshot ();
+  long long iFirst = iGen;
+
+  /* journals the snapshot covers may be left over if we crashed just after it finished */
+  for (long long iOld = iGen - 1; iOld >= 0; iOld--)
+    if (unlink (str (JournalName (iOld))) == -1)
       break;
 
-    /* whoops! */
-    default:
-      fprintf (stderr, "Invalid connstate %i for connection %i\n",
-                     p->connstate, p->s);
+  int iRecords = 0;
+  while (ReplayJournal (iGen, iRecords))
+    iGen++;
+
+  /* append to the last journal that existed (or start the first) */
+  if (!OpenJournal (iGen > iFirst ? iGen - 1 : iGen))
+    return 1;
+
+  iJournalRecords = iRecords;
+  tLastSnapshot = time (NULL);
+
+  gettimeofday (&tEnd, NULL);
+  printf ("Recovered %i players (%i journal records) in %li ms\n",
+          (int) playerrecords.size (), iRecords,
+          (long) ((tEnd.tv_sec - tStart.tv_sec) * 1000 +
+                  (tEnd.tv_usec - tStart.tv_usec) / 1000));
+  return 0;
+}	/* end of RecoverWorld */
+
+/*---------------------------------------------- */
+/*  session recorder - see also ReplayTrace */
+/*---------------------------------------------- */
+
+/* Run with "-r <file>" to record every connection, input line and disconnection
+   to a trace file. "-p <file> [speed]" plays a trace back against a fresh server.
+
+   The file is TRACE_MAGIC, then records of: a type byte, then as varints the
+   microseconds since the previous record, the connection number, and a value
+   (the protocol for eTraceConnect, the length of the line that follows for
+   eTraceLogin and eTraceInput, or the bytes sent to the player for eTraceClose).
+   Passwords are recorded too, so the file is only readable by its owner. */
+
+enum
+{
+  eTraceConnect = 1,
+  eTraceLogin,      /* a name or password line */
+  eTraceInput,      /* a command line */
+  eTraceClose,
+};
+
+static int iTrace = NO_SOCKET;    /* trace file, NO_SOCKET if not recording */
+string sTraceOut;                 /* records not yet written to it */
+long long iLastTraceTime = 0;     /* time of the previous record, microseconds */
+
+/* microseconds on a clock that never goes backwards */
+
+long long MonotonicMicroseconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}	/* end of MonotonicMicroseconds */
+
+/* append a number, 7 bits per byte, small numbers taking one byte */
+
+void PutVarint (string & buf, unsigned long long iNumber)
+{
+  while (iNumber >= 0x80)
+    {
+    buf += (char) (iNumber | 0x80);
+    iNumber >>= 7;
+    }
+  buf += (char) iNumber;
+}	/* end of PutVarint */
+
+/* extract a number written by PutVarint, false if malformed */
+
+bool GetVarint (const string & buf, string::size_type & pos, unsigned long long & iNumber)
+{
+  iNumber = 0;
+  for (int iShift = 0; pos < buf.length () && iShift < 64; iShift += 7)
+    {
+    unsigned char c = buf [pos++];
+    iNumber |= (unsigned long long) (c & 0x7F) << iShift;
+    if (!(c & 0x80))
+      return true;
+    }
+  return false;
+}	/* end of GetVarint */
+
+/* start recording to a trace file */
+
+bool OpenTrace (const string & name)
+{
+  iTrace = open (str (name), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (iTrace == -1)
+    {
+    perror (str (name));
+    iTrace = NO_SOCKET;
+    return false;
+    }
+
+  sTraceOut = TRACE_MAGIC;
+  iLastTraceTime = MonotonicMicroseconds ();
+  printf ("Recording sessions to %s\n", str (name));
+  return true;
+}	/* end of OpenTrace */
+
+/* add a record to the trace (does nothing if not recording) */
+
+void Trace (const int iType, const long long iConnection,
+            const long long iValue, const string & line = "")
+{
+  if (iTrace == NO_SOCKET)
+    return;
+
+  long long iNow = MonotonicMicroseconds ();
+  sTraceOut += (char) iType;
+  PutVarint (sTraceOut, iNow - iLastTraceTime);
+  PutVarint (sTraceOut, iConnection);
+  PutVarint (sTraceOut, iValue);
+  sTraceOut += line;
+  iLastTraceTime = iNow;
+}	/* end of Trace */
+
+/* write out the records so far - once per pass of the main loop */
+
+void TraceFlush (void)
+{
+  if (iTrace == NO_SOCKET || sTraceOut.empty ())
+    return;
+
+  string::size_type iDone = 0;
+  while (iDone < sTraceOut.length ())
+    {
+    int nWrite = write (iTrace, sTraceOut.data () + iDone, sTraceOut.length () - iDone);
+    if (nWrite < 0)
+      {
+      if (errno == EINTR)
+        continue;
+      perror ("write to trace");
       break;
+      }
+    iDone += nWrite;
     }
-}	/* end of ProcessPlayerInput */
 
-/* new player has connected */
+  sTraceOut.erase ();
+}	/* end of TraceFlush */
+
+/*---------------------------------------------- */
+/*  creatures */
+/*---------------------------------------------- */
+
+/* Each creature is an index into these arrays, rather than an object, so that
+   each step of a tick runs down one or two arrays at a time, which keeps the
+   cache full of useful data and lets the compiler vectorise the simpler loops. */
+
+enum
+{
+  eNpcIdle,
+  eNpcWandering,
+  eNpcResting,
+};
 
-void ProcessNewConnection (void)
+struct tNpcWorld
   {
-  static struct sockaddr_in sa;
-  socklen_t sa_len = sizeof sa;		
+  int iCount;
+  vector<int> room;
+  vector<int> hp;
+  vector<int> maxhp;
+  vector<int> state;            /* eNpcIdle etc. */
+  vector<int> timer;            /* ticks until it next decides what to do */
+  vector<unsigned int> seed;    /* its own random numbers, so threads don't share */
+  vector<int> roomcount;        /* creatures in each room, after the last tick */
+
+  tNpcWorld () : iCount (0) {}
+  };
+
+tNpcWorld npcs;
+
+/* tick timing, in microseconds */
+long long iNpcNextTick = 0;
+long long iNpcTicks = 0;
+long long iNpcLastTick = 0;
+long long iNpcTotalTime = 0;
+long long iNpcWorstTick = 0;
+long long iNpcOverruns = 0;
+
+/* a cheap random number generator (xorshift) - never returns 0 if not given 0 */
+
+inline unsigned int NpcRandom (unsigned int & iSeed)
+{
+  iSeed ^= iSeed << 13;
+  iSeed ^= iSeed >> 17;
+  iSeed ^= iSeed << 5;
+  return iSeed;
+}	/* end of NpcRandom */
 
-  int s;		/* incoming socket */
+/* how many threads a tick uses */
+
+int NpcThreads (void)
+{
+  return npcs.iCount >= NPC_THREAD_MIN ? NPC_THREADS : 1;
+}	/* end of NpcThreads */
+
+/* recount the creatures in each room */
+
+void NpcCountRooms (void)
+{
+  fill (npcs.roomcount.begin (), npcs.roomcount.end (), 0);
+  const int * room = &npcs.room [0];
+  int * roomcount = &npcs.roomcount [0];
+  for (int i = 0; i < npcs.iCount; i++)
+    roomcount [room [i]]++;
+}	/* end of NpcCountRooms */
+
+/* create the creatures, scattered about the rooms */
+
+void InitNpcs (const int iCount)
+{
+  tMemoryOwner owner (0, eMemCreatures);
+  npcs.iCount = iCount;
+  npcs.room.resize (iCount);
+  npcs.hp.resize (iCount);
+  npcs.maxhp.resize (iCount);
+  npcs.state.resize (iCount);
+  npcs.timer.resize (iCount);
+  npcs.seed.resize (iCount);
+  npcs.roomcount.resize (NPC_ROOMS);
+
+  for (int i = 0; i < iCount; i++)
+    {
+    unsigned int iSeed = (i + 1) * 2654435761U;
+    if (iSeed == 0)
+      iSeed = 1;
+    npcs.room [i] = NpcRandom (iSeed) % NPC_ROOMS;
+    npcs.maxhp [i] = npcs.hp [i] = 20 + NpcRandom (iSeed) % 80;
+    npcs.state [i] = eNpcIdle;
+    npcs.timer [i] = 1 + NpcRandom (iSeed) % 20;
+    npcs.seed [i] = iSeed;
+    }
+
+  NpcCountRooms ();
+  iNpcNextTick = MonotonicMicroseconds () + NPC_TICK_USEC;
+
+  if (iCount)
+    printf ("Simulating %i creatures in %i rooms\n", iCount, NPC_ROOMS);
+}	/* end of InitNpcs */
+
+/* AI - when its timer runs out, a creature picks something else to do */
+
+void NpcDecide (const int iFirst, const int iLast)
+{
+  int * state = &npcs.state [0];
+  int * timer = &npcs.timer [0];
+  const int * hp = &npcs.hp [0];
+  const int * maxhp = &npcs.maxhp [0];
+  unsigned int * seed = &npcs.seed [0];
+
+  for (int i = iFirst; i < iLast; i++)
+    {
+    /* worn out creatures stop wandering */
+    if (state [i] == eNpcWandering && hp [i] * 4 < maxhp [i])
+      timer [i] = 0;
+
+    if (--timer [i] > 0)
+      continue;
+
+    unsigned int iRandom = NpcRandom (seed [i]);
+    if (hp [i] * 2 < maxhp [i])
+      state [i] = eNpcResting;
+    else
+      state [i] = iRandom % 3;    /* idle, wandering or resting */
+    timer [i] = 5 + (iRandom >> 8) % 20;
+    }
+}	/* end of NpcDecide */
+
+/* movement - wandering creatures go to a neighbouring room */
+
+void NpcMove (const int iFirst, const int iLast)
+{
+  int * room = &npcs.room [0];
+  const int * state = &npcs.state [0];
+  unsigned int * seed = &npcs.seed [0];
+
+  for (int i = iFirst; i < iLast; i++)
+    {
+    int iStep = (int) (NpcRandom (seed [i]) % 3) - 1;    /* -1, 0 or 1 */
+    iStep &= -(state [i] == eNpcWandering);              /* only if wandering */
+    room [i] = (room [i] + iStep + NPC_ROOMS) % NPC_ROOMS;
+    }
+}	/* end of NpcMove */
+
+/* hit points - wandering tires creatures, resting heals them faster */
+
+void NpcRegenerate (const int iFirst, const int iLast)
+{
+  int * hp = &npcs.hp [0];
+  const int * maxhp = &npcs.maxhp [0];
+  const int * state = &npcs.state [0];
+
+  for (int i = iFirst; i < iLast; i++)
+    {
+    int iChange = (state [i] == eNpcResting) * 3 + (state [i] == eNpcIdle) -
+                  (state [i] == eNpcWandering);
+    hp [i] = max (1, min (hp [i] + iChange, maxhp [i]));
+    }
+}	/* end of NpcRegenerate */
+
+/* one thread's share of a tick */
+
+struct tNpcSlice
+  {
+  int iFirst;
+  int iLast;
+  bool bWorker;     /* a worker thread does it, otherwise the main thread does */
+  };
+
+void NpcUpdate (const tNpcSlice & slice)
+{
+  NpcDecide (slice.iFirst, slice.iLast);
+  NpcMove (slice.iFirst, slice.iLast);
+  NpcRegenerate (slice.iFirst, slice.iLast);
+}	/* end of NpcUpdate */
+
+/* The worker threads are started once, at startup, and wait for each tick -
+   starting threads every tick would cost about as much as the tick itself.
+   NpcTick bumps iNpcGeneration to start them, and waits for iNpcBusy to get
+   back to zero. */
+
+tNpcSlice npcslices [NPC_THREADS];
+pthread_t npcworkers [NPC_THREADS];
+int iNpcSlices = 0;
+int iNpcWorkers = 0;              /* how many threads actually started */
+
+pthread_mutex_t npcmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t npcstart = PTHREAD_COND_INITIALIZER;   /* workers wait on this for a tick */
+pthread_cond_t npcdone = PTHREAD_COND_INITIALIZER;    /* NpcTick waits on this for them */
+long long iNpcGeneration = 0;     /* the tick the workers should be doing */
+int iNpcBusy = 0;                 /* workers still doing it */
+bool bNpcStop = false;            /* shutting down */
+
+void * NpcWorker (void * arg)
+{
+  const tNpcSlice * slice = (const tNpcSlice *) arg;
+  long long iDone = 0;
+
+  pthread_mutex_lock (&npcmutex);
+  for ( ; ; )
+    {
+    while (iNpcGeneration == iDone && !bNpcStop)
+      pthread_cond_wait (&npcstart, &npcmutex);
+    if (bNpcStop)
+      break;
+    iDone = iNpcGeneration;
+
+    pthread_mutex_unlock (&npcmutex);
+    NpcUpdate (*slice);
+    pthread_mutex_lock (&npcmutex);
+
+    if (--iNpcBusy == 0)
+      pthread_cond_signal (&npcdone);
+    }
+  pthread_mutex_unlock (&npcmutex);
+  return NULL;
+}	/* end of NpcWorker */
+
+/* share the creatures out between the threads, and start all but the first */
+
+void StartNpcWorkers (void)
+{
+  iNpcSlices = npcs.iCount ? NpcThreads () : 0;
+
+  /* signals (eg. SIGTERM) should wake the main loop, so the workers block them */
+  sigset_t allsignals, oldsignals;
+  sigfillset (&allsignals);
+  pthread_sigmask (SIG_BLOCK, &allsignals, &oldsignals);
+
+  for (int i = 0; i < iNpcSlices; i++)
+    {
+    tNpcSlice & slice = npcslices [i];
+    slice.iFirst = (long long) npcs.iCount * i / iNpcSlices;
+    slice.iLast = (long long) npcs.iCount * (i + 1) / iNpcSlices;
+    slice.bWorker = i > 0 && pthread_create (&npcworkers [iNpcWorkers], NULL, NpcWorker, &slice) == 0;
+    if (slice.bWorker)
+      iNpcWorkers++;
+    }
+
+  pthread_sigmask (SIG_SETMASK, &oldsignals, NULL);
+}	/* end of StartNpcWorkers */
+
+/* stop the worker threads - at shutdown */
+
+void StopNpcWorkers (void)
+{
+  pthread_mutex_lock (&npcmutex);
+  bNpcStop = true;
+  pthread_cond_broadcast (&npcstart);
+  pthread_mutex_unlock (&npcmutex);
+
+  for (int i = 0; i < iNpcWorkers; i++)
+    pthread_join (npcworkers [i], NULL);
+  iNpcWorkers = 0;
+}	/* end of StopNpcWorkers */
+
+/* move the creatures along, if it is time - called every pass of the main loop */
+
+void NpcTick (void)
+{
+  long long iStart = MonotonicMicroseconds ();
+  if (npcs.iCount == 0 || iStart < iNpcNextTick)
+    return;
+
+  /* the creatures are independent of each other, so each thread takes a slice */
+  if (iNpcWorkers)
+    {
+    pthread_mutex_lock (&npcmutex);
+    iNpcBusy = iNpcWorkers;
+    iNpcGeneration++;
+    pthread_cond_broadcast (&npcstart);
+    pthread_mutex_unlock (&npcmutex);
+    }
+
+  /* this thread does the first slice, and any a thread could not be started for */
+  for (int i = 0; i < iNpcSlices; i++)
+    if (!npcslices [i].bWorker)
+      NpcUpdate (npcslices [i]);
+
+  if (iNpcWorkers)
+    {
+    pthread_mutex_lock (&npcmutex);
+    while (iNpcBusy)
+      pthread_cond_wait (&npcdone, &npcmutex);
+    pthread_mutex_unlock (&npcmutex);
+    }
+
+  NpcCountRooms ();
+
+  /* if we fell behind, don't try to catch up with a burst of ticks */
+  long long iEnd = MonotonicMicroseconds ();
+  iNpcNextTick = max (iNpcNextTick + NPC_TICK_USEC, iEnd);
+
+  iNpcLastTick = iEnd - iStart;
+  iNpcTicks++;
+  iNpcTotalTime += iNpcLastTick;
+  iNpcWorstTick = max (iNpcWorstTick, iNpcLastTick);
+  if (iNpcLastTick > NPC_TICK_BUDGET)
+    iNpcOverruns++;
+}	/* end of NpcTick */
+
+/*---------------------------------------------- */
+/*  message catalogs */
+/*---------------------------------------------- */
+
+/* default text and name of each message, by number */
+
+static const char * defaultmessages [eMessageCount] =
+{
+#define MESSAGE(name) name,
+  MESSAGES
+#undef MESSAGE
+};
+
+static const char * messagenames [eMessageCount] =
+{
+#define MESSAGE(name) #name,
+  MESSAGES
+#undef MESSAGE
+};
+
+/* The arguments a printf format expects, eg. "%s is %i" gives "s,i". A catalog
+   message must expect the same arguments as the default, or the server would
+   crash formatting it. */
+
+string FormatSignature (const char * format)
+{
+  string signature;
+
+  for (const char * p = strchr (format, '%'); p; p = strchr (p, '%'))
+    {
+    p++;
+    if (*p == '%')
+      {
+      p++;		/* %% is just a percent sign */
+      continue;
+      }
+
+    /* flags, width, precision - a * takes an argument */
+    for ( ; *p && strchr ("-+ #0123456789.*", *p); p++)
+      if (*p == '*')
+        signature += "*,";
+
+    /* length modifiers and conversion */
+    for ( ; *p && strchr ("hlLqjzt", *p); p++)
+      signature += *p;
+    if (*p)
+      signature += *p++;
+    signature += ',';
+    }
+
+  return signature;
+}	/* end of FormatSignature */
+
+/* message number from its name, -1 if there is no such message */
+
+int FindMessage (const string & name)
+{
+  static map<string, int> messagenumbers;
+
+  if (messagenumbers.empty ())
+    for (int i = 0; i < eMessageCount; i++)
+      messagenumbers [messagenames [i]] = i;
+
+  map<string, int>::const_iterator numberiter = messagenumbers.find (name);
+  return numberiter == messagenumbers.end () ? -1 : numberiter->second;
+}	/* end of FindMessage */
+
+/* file name of the catalog for a language */
+
+string CatalogName (const string & code)
+{
+  return CATALOG_PREFIX + code + CATALOG_SUFFIX;
+}	/* end of CatalogName */
+
+/* Map a language's catalog into memory and point its messages at it. The
+   catalog is:
+
+     4 bytes  CATALOG_MAGIC
+     4 bytes  number of entries
+     entries  each a 4-byte offset of the message name, then of its text
+     strings  the names and texts, each followed by a NUL
+
+   Anything the catalog lacks (or gets wrong) uses the default text. If there
+   is no catalog at all the language uses the defaults, but we return false. */
+
+bool LoadCatalog (tLanguage & lang)
+{
+  const void * pOldMap = lang.pMap;
+  size_t iOldSize = lang.iMapSize;
+  const char * pMap = NULL;
+  size_t iSize = 0;
+
+  string filename = CatalogName (lang.code);
+  int fd = open (str (filename), O_RDONLY);
+
+  if (fd != NO_SOCKET)
+    {
+    struct stat st;
+    if (fstat (fd, &st) == 0 && st.st_size > 0)
+      {
+      iSize = st.st_size;
+      void * pMapped = mmap (NULL, iSize, PROT_READ, MAP_SHARED, fd, 0);
+      if (pMapped == MAP_FAILED)
+        perror ("mmap of message catalog");
+      else
+        pMap = (const char *) pMapped;
+      }
+    close (fd);		/* the mapping stays valid */
+    }
+
+  /* start from the defaults, then take what we can from the catalog */
+  for (int i = 0; i < eMessageCount; i++)
+    lang.text [i] = defaultmessages [i];
+
+  unsigned int iCount = 0;
+  const char * pMagic = CATALOG_MAGIC;
+
+  if (pMap && (iSize < 8 || memcmp (pMap, pMagic, 4) != 0))
+    {
+    fprintf (stderr, "%s is not a message catalog\n", str (filename));
+    munmap ((void *) pMap, iSize);
+    pMap = NULL;
+    iSize = 0;
+    }
+  else if (pMap)
+    memcpy (&iCount, pMap + 4, sizeof iCount);
+
+  /* is there a NUL-terminated string at this offset? */
+  #define CATALOG_STRING_OK(offset) \
+    ((offset) < iSize && memchr (pMap + (offset), 0, iSize - (offset)) != NULL)
+
+  for (unsigned int iEntry = 0; iEntry < iCount && 8 + (iEntry + 1) * 8 <= iSize; iEntry++)
+    {
+    unsigned int iOffsets [2];
+    memcpy (iOffsets, pMap + 8 + iEntry * 8, sizeof iOffsets);
+
+    if (!CATALOG_STRING_OK (iOffsets [0]) || !CATALOG_STRING_OK (iOffsets [1]))
+      {
+      fprintf (stderr, "%s: entry %u is damaged\n", str (filename), iEntry);
+      continue;
+      }
+
+    const char * name = pMap + iOffsets [0];
+    const char * text = pMap + iOffsets [1];
+    int iMsg = FindMessage (name);
+
+    if (iMsg < 0)
+      fprintf (stderr, "%s: unknown message %s\n", str (filename), name);
+    else if (FormatSignature (text) != FormatSignature (defaultmessages [iMsg]))
+      fprintf (stderr, "%s: %s has the wrong %% codes, using the default\n",
+               str (filename), name);
+    else
+      lang.text [iMsg] = text;
+    }
+
+  #undef CATALOG_STRING_OK
+
+  /* work out once which messages need formatting */
+  for (int i = 0; i < eMessageCount; i++)
+    lang.bPlain [i] = strchr (lang.text [i], '%') == NULL;
+
+  lang.pMap = pMap;
+  lang.iMapSize = iSize;
+
+  /* nothing points into the old mapping any more */
+  if (pOldMap)
+    munmap ((void *) pOldMap, iOldSize);
+
+  return pMap != NULL;
+}	/* end of LoadCatalog */
+
+/* find a language by code - if bLoad, load its catalog if we haven't yet.
+   Returns the language number, or -1. */
+
+int FindLanguage (const string & code, const bool bLoad = false)
+{
+  for (int i = 0; i < iLanguages; i++)
+    if (languages [i].code == code)
+      return i;
+
+  if (!bLoad || iLanguages >= MAX_LANGUAGES)
+    return -1;
+
+  tLanguage & lang = languages [iLanguages];
+  lang.code = code;
+
+  /* the default language is allowed not to have a catalog - others must */
+  if (LoadCatalog (lang))
+    printf ("Loaded messages for language %s\n", str (code));
+  else if (iLanguages > 0)
+    return -1;
+
+  return iLanguages++;
+}	/* end of FindLanguage */
+
+/* SIGHUP - map every loaded catalog again, to pick up changes */
+
+void ReloadLanguages (void)
+{
+  bReloadMessages = 0;
+  for (int i = 0; i < iLanguages; i++)
+    {
+    LoadCatalog (languages [i]);
+    printf ("Reloaded messages for language %s\n", str (languages [i].code));
+    }
+}	/* end of ReloadLanguages */
+
+/* SendBuffer - used for sending printf style strings */
+
+char SendBuffer [1000];
+
+void SendV (tPlayer * p, const char * message, va_list ap)
+{
+  if (p->s == NO_SOCKET)
+    return;
+
+  tMemoryOwner owner (p->iAccount, eMemOutput);
+  int iSent = vsnprintf (SendBuffer, (sizeof SendBuffer) - 1, message, ap);
+
+  if (iSent == -1)
+    {
+    fprintf (stderr, "Message too long to be sent to player %i\n", p->s);
+    return;
+    }
+
+  p->outbuf.push_back (make_shared<const string> (SendBuffer));
+}	/* end of SendV */
+
+void Send (tPlayer * p, const char * message, ...)
+{
+  va_list ap;
+  va_start (ap, message);
+  SendV (p, message, ap);
+  va_end (ap);
+}	/* end of Send */
+
+/* send one of the MESSAGES, in the player's language */
+
+void SendMsg (tPlayer * p, const int iMsg, ...)
+{
+  if (p->s == NO_SOCKET)
+    return;
+
+  const tLanguage & lang = languages [p->iLanguage];
+  tMemoryOwner owner (p->iAccount, eMemOutput);
+
+  /* most messages have nothing to fill in - don't bother formatting them */
+  if (lang.bPlain [iMsg])
+    {
+    p->outbuf.push_back (make_shared<const string> (lang.text [iMsg]));
+    return;
+    }
+
+  va_list ap;
+  va_start (ap, iMsg);
+  SendV (p, lang.text [iMsg], ap);
+  va_end (ap);
+}	/* end of SendMsg */
+
+/* one of the MESSAGES in a given language - messages sent to everyone can
+   only have %s codes, up to two of them */
+
+tText FormatMsg (const tLanguage & lang, const int iMsg,
+                 const string & s1, const string & s2)
+{
+  if (lang.bPlain [iMsg])
+    return make_shared<const string> (lang.text [iMsg]);
+
+  snprintf (SendBuffer, sizeof SendBuffer, lang.text [iMsg], str (s1), str (s2));
+  return make_shared<const string> (SendBuffer);
+}	/* end of FormatMsg */
+
+/* what players say to each other, as opposed to notices from the server */
+
+bool IsChatter (const int iMsg)
+{
+  return iMsg == M_SOMEONE_SAYS;
+}	/* end of IsChatter */
+
+/* send one of the MESSAGES to all players connected to this process,
+   excepting "ExceptThis" (which can be null) */
+
+void SendToLocal (tPlayer * ExceptThis, const int iMsg,
+                  const string & s1 = "", const string & s2 = "")
+{
+  /* short of memory - chatter is the first thing to go */
+  if (bMemoryShort && IsChatter (iMsg))
+    {
+    iMessagesDropped++;
+    return;
+    }
+
+  /* formatted once for each language in use, and shared by its players */
+  tText texts [MAX_LANGUAGES];
+
+  for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+    {
+    tPlayer * p = *listiter;
+
+    if (p != ExceptThis &&					/* ignore this player */
+        p->s != NO_SOCKET &&				/* don't if not connected */
+        p->connstate == ePlaying)		/* only send if playing (eg. entered name etc.) */
+      {
+      /* the shared text belongs to the server, only its place in the queue to the player */
+      tText & text = texts [p->iLanguage];
+      if (!text)
+        {
+        tMemoryOwner shared (0, eMemOutput);
+        text = FormatMsg (languages [p->iLanguage], iMsg, s1, s2);
+        }
+      tMemoryOwner recipient (p->iAccount, eMemOutput);
+      p->outbuf.push_back (text);
+      }
+
+    }
+}	/* end of SendToLocal */
+
+/* send message to all connected players, excepting "ExceptThis" (which can be null) */
+
+void SendToAll (tPlayer * ExceptThis, const int iMsg,
+                const string & s1 = "", const string & s2 = "")
+{
+  SendToLocal (ExceptThis, iMsg, s1, s2);
+
+  /* players on other shards get it via the router, and format it themselves */
+  char sMsg [20];
+  snprintf (sMsg, sizeof sMsg, "%i", iMsg);
+  BusSend (eBusBroadcast, sMsg, s1, s2);
+}	/* end of SendToAll */
+
+/*---------------------------------------------- */
+/*  channels */
+/*---------------------------------------------- */
+
+/* find a channel by name - if bCreate, make it if it doesn't exist (NULL if we can't) */
+
+tChannel * FindChannel (const string & name, const bool bCreate = false)
+{
+  tChannelMapIterator channeliter = channels.find (name);
+  if (channeliter != channels.end ())
+    return &channeliter->second;
+
+  if (!bCreate || channels.size () >= MAX_CHANNELS)
+    return NULL;
+
+  tMemoryOwner owner (0, eMemChannels);
+
+  tChannel * c = &channels [name];
+  c->name = name;
+  return c;
+}	/* end of FindChannel */
+
+/* the channels that always exist */
+
+void InitChannels (void)
+{
+  FindChannel ("global", true)->bPermanent = true;
+
+  tChannel * c = FindChannel ("admin", true);
+  c->bPermanent = true;
+  c->bAdmin = true;
+}	/* end of InitChannels */
+
+/* send already-formatted text to this process's subscribers, and add it to the history */
+
+void DeliverToChannel (tChannel * c, const char * message)
+{
+  if (bMemoryShort)
+    {
+    iMessagesDropped++;
+    return;
+    }
+
+  /* one copy of the text, shared by every subscriber and the history */
+  tMemoryOwner owner (0, eMemChannels);
+  tText text = make_shared<const string> (message);
+
+  for (set<tPlayer *>::iterator subiter = c->subscribers.begin (); subiter != c->subscribers.end (); subiter++)
+    {
+    tPlayer * p = *subiter;
+    if (p->s != NO_SOCKET)
+      {
+      tMemoryOwner subscriber (p->iAccount, eMemOutput);
+      p->outbuf.push_back (text);
+      }
+    }
+
+  c->history [c->iHistoryNext] = text;
+  c->iHistoryNext = (c->iHistoryNext + 1) % CHANNEL_HISTORY;
+  if (c->iHistoryCount < CHANNEL_HISTORY)
+    c->iHistoryCount++;
+}	/* end of DeliverToChannel */
+
+/* send printf style message to everyone on a channel, on every shard */
+
+void PublishToChannel (tChannel * c, const char * message, ...)
+{
+  va_list ap;
+  va_start (ap, message);
+  int iSent = vsnprintf (SendBuffer, (sizeof SendBuffer) - 1, message, ap);
+  va_end (ap);
+
+  if (iSent == -1)
+    {
+    fprintf (stderr, "Message too long to be sent to channel %s\n", str (c->name));
+    return;
+    }
+
+  DeliverToChannel (c, SendBuffer);
+  BusSend (eBusChannel, c->name, SendBuffer);
+}	/* end of PublishToChannel */
+
+/* start listening to a channel, and catch up on what was said before */
+
+void JoinChannel (tPlayer * p, tChannel * c)
+{
+  c->subscribers.insert (p);
+  p->channels.insert (c);
+
+  /* replay the history, oldest first */
+  tMemoryOwner owner (p->iAccount, eMemOutput);
+  int iFirst = (c->iHistoryNext - c->iHistoryCount + CHANNEL_HISTORY) % CHANNEL_HISTORY;
+  for (int i = 0; i < c->iHistoryCount; i++)
+    p->outbuf.push_back (c->history [(iFirst + i) % CHANNEL_HISTORY]);
+}	/* end of JoinChannel */
+
+/* stop listening to a channel */
+
+void LeaveChannel (tPlayer * p, tChannel * c)
+{
+  c->subscribers.erase (p);
+  p->channels.erase (c);
+
+  /* channels players made up go when the last one leaves, so they can't fill the table */
+  if (!c->bPermanent && c->subscribers.empty ())
+    channels.erase (channels.find (c->name));
+}	/* end of LeaveChannel */
+
+/* take a player off every channel - do this before deleting them */
+
+void LeaveAllChannels (tPlayer * p)
+{
+  while (!p->channels.empty ())
+    LeaveChannel (p, *p->channels.begin ());
+}	/* end of LeaveAllChannels */
+
+void ClosePlayer (tPlayer * p)
+{
+  /* close comms connection */
+  if (p->s != NO_SOCKET)
+    close (p->s);
+  p->s = NO_SOCKET;
+}	/* end of ClosePlayer */
+
+void ProcessPlayerName (string & sLine, tPlayer * p)
+{
+  /* name can't be blank */
+  if (sLine.empty ())
+    {
+    SendMsg (p, M_TELL_NAME);
+    return;
+    }
+
+  /* don't allow two of the same name */
+  if (FindPlayer (str (sLine)) || remoteplayers.count (sLine))
+    {
+    SendMsg (p, M_ALREADY_CONNECTED, str (sLine));
+    SendMsg (p, M_TELL_NAME);
+    return;
+    }
+
+  /* admin rights come with the name, so it needs a real password */
+  if (sLine == ADMIN_NAME && sAdminPassword.empty ())
+    {
+    SendMsg (p, M_ADMIN_DISABLED, ADMIN_NAME);
+    SendMsg (p, M_TELL_NAME);
+    return;
+    }
+  
+  /* players who have been here before are in playerrecords, anyone else is new */
+  /* you might also allow for 'new' to allow new players to be created */
+  
+  p->playername = sLine;
+  p->connstate = eAwaitingPassword;
+  SendMsg (p, M_TELL_PASSWORD);
+  
+}	/* end of ProcessPlayerName */
+
+void ProcessPlayerPassword (string & sLine, tPlayer * p)
+{
+  /* password can't be blank */
+  if (sLine.empty ())
+    {
+    SendMsg (p, M_TELL_PASSWORD);
+    return;
+    }
+
+  /* players we have not seen before use their name as their password, for testing,
+     but the admin always has the one they were given at startup */
+
+  tPlayerRecordIterator recorditer = playerrecords.find (p->playername);
+  const string & password = p->playername == ADMIN_NAME ? sAdminPassword :
+                            recorditer == playerrecords.end () ?
+                            p->playername : recorditer->second.password;
+
+  if (sLine != password)
+    {
+    SendMsg (p, M_PASSWORD_INCORRECT);
+    SendMsg (p, M_TELL_PASSWORD);
+    return;
+    }
+  
+  char sNow [30];
+  snprintf (sNow, sizeof sNow, "%li", (long) time (NULL));
+  Journal (eJournalLogin, p->playername, sNow);
+
+  p->connstate = ePlaying;
+  p->bAdmin = p->playername == ADMIN_NAME;
+  SendMsg (p, M_WELCOME, str (p->playername));
+  DoLook (p);		/* new player looks around */
+  /* other shards announce it when the router passes on the join - it won't if
+     the name is already in use there */
+  SendToLocal (p, M_PLAYER_JOINED, p->playername);
+  BusSend (eBusJoin, p->playername);
+
+  /* everyone hears the global channel, admins hear the admin one */
+  JoinChannel (p, FindChannel ("global"));
+  if (p->bAdmin)
+    JoinChannel (p, FindChannel ("admin"));
+
+  /* log on console */
+  printf ("Player %s has joined the game.\n", str (p->playername));
+
+}	/* end of ProcessPlayerPassword */
+
+/* disconnect a player, for whatever reason - the player is deleted next time
+   around the main loop */
+
+void DisconnectPlayer (tPlayer * p)
+  {
+  /* if s/he finished connecting, tell others s/he has left */
+  
+  if (p->connstate == ePlaying)
+    {
+    printf ("Player %s has left the game.\n", str (p->playername));
+    SendToLocal (p, M_PLAYER_LEFT, p->playername);   
+    BusSend (eBusLeave, p->playername);		/* other shards announce it */
+    }	/* end of properly connected */
+
+  /* tell a browser we are closing - once what could be sent has gone, so the
+     close frame is last (anything that couldn't go is lost anyway) */
+  if (p->protocol == eWebSocket)
+    {
+    ProcessWrite (p);
+    WebSocketControl (p, 8, "");
+    ProcessWrite (p);
+    }
+
+  ClosePlayer (p);
+  }	/* end of DisconnectPlayer */
+
+/* quit */
+
+void DoQuit (tPlayer * p)
+  {
+  if (p->connstate == ePlaying)
+    {
+    SendMsg (p, M_FINAL_STRING);
+    JournalFlush ();		/* their changes are saved before they see goodbye */
+    ProcessWrite (p);		/* force message out */
+    }
+
+  DisconnectPlayer (p);
+  }	/* end of DoQuit */
+
+/* look */
+
+void DoLook (tPlayer * p)
+{
+  SendMsg (p, M_LOOK_STRING);
+
+  /* list other players in the same room */
+  /* in practice we would check the room number to be the same as ours */
+  
+  int iOthers = 0;
+  for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+    {
+    tPlayer *otherp = *listiter;
+    if (otherp != p &&	/* we don't see ourselves */
+        otherp->connstate == ePlaying &&  /* must be connected */
+        otherp->s != NO_SOCKET)  /* and not about to leave  */
+      {
+      if (iOthers++ == 0)
+        SendMsg (p, M_IN_THE_ROOM);
+      else
+        Send (p, ", ");
+      Send (p, str (otherp->playername));
+      }
+    }		/* end of looping through all players */
+
+  /* If we listed anyone, finish up the line with a period, newline */
+  if (iOthers)
+    Send (p, ".\n");
+
+  if (npcs.iCount && npcs.roomcount [0])
+    SendMsg (p, M_CREATURES_HERE, npcs.roomcount [0]);
+
+}	/* end of DoLook */
+
+/* say <something> */
+
+void DoSay (tPlayer * p, string sWhat)
+{
+  if (sWhat.empty ())
+    SendMsg (p, M_SAY_WHAT);
+  else
+    {
+    SendMsg (p, M_YOU_SAY, str (sWhat));
+    SendToAll (p, M_SOMEONE_SAYS, p->playername, sWhat);
+    }
+}	/* end of DoSay */
+
+/* tell <someone> <something> */
+
+void DoTell (tPlayer * p, string sWhat)
+{
+  /* error if nothing after 'tell' */
+  if (sWhat.empty ())
+    {
+    SendMsg (p, M_TELL_WHOM);
+    return;    
+    }
+
+  /* next word is who to tell it to */
+
+  string who = GetWord (sWhat);
+
+  if (sWhat.empty ())
+    {
+    SendMsg (p, M_TELL_WHAT, str (who));
+    return;
+    }
+
+  /* scan player list to find a player of this name */
+  
+  tPlayer * ptarget = FindPlayer (str (who));
+
+  /* not here - if they are on another shard the router will pass it on */
+  if (!ptarget && remoteplayers.count (who))
+    {
+    BusSend (eBusTell, p->playername, who, sWhat);
+    return;
+    }
+
+  if (!ptarget)
+    {
+    SendMsg (p, M_NOT_CONNECTED, str (who));
+    return;
+    }
+
+  if (p == ptarget)
+    {
+    SendMsg (p, M_NOT_SELF);
+    return;
+    }
+  
+  SendMsg (p, M_YOU_TELL, str (who), str (sWhat));
+  SendMsg (ptarget, M_SOMEONE_TELLS, str (p->playername), str (sWhat));
+  
+}	/* end of DoTell */
+
+/* password <new password> */
+
+void DoPassword (tPlayer * p, string sWhat)
+{
+  if (sWhat.empty ())
+    {
+    SendMsg (p, M_PASSWORD_WHAT);
+    return;
+    }
+
+  if (p->playername == ADMIN_NAME)
+    {
+    SendMsg (p, M_ADMIN_PASSWORD_FIXED);
+    return;
+    }
+
+  /* shards don't share their player records, or save them - the change would
+     only last until the router sent them to another shard */
+  if (iShard >= 0)
+    {
+    SendMsg (p, M_PASSWORD_NOT_SAVED);
+    return;
+    }
+
+  Journal (eJournalPassword, p->playername, sWhat);
+  SendMsg (p, M_PASSWORD_CHANGED);
+}	/* end of DoPassword */
+
+/* check a channel name is sensible, telling the player if it isn't */
+
+bool ValidChannelName (tPlayer * p, const string & name)
+{
+  if (name.empty ())
+    {
+    SendMsg (p, M_CHANNEL_WHICH);
+    return false;
+    }
+
+  bool bValid = name.length () <= MAX_CHANNEL_NAME;
+  for (string::size_type i = 0; bValid && i < name.length (); i++)
+    bValid = isalnum ((unsigned char) name [i]);
+
+  if (!bValid)
+    SendMsg (p, M_CHANNEL_BAD_NAME, MAX_CHANNEL_NAME);
+
+  return bValid;
+}	/* end of ValidChannelName */
+
+/* channels */
+
+void DoChannels (tPlayer * p)
+{
+  SendMsg (p, M_CHANNEL_LIST);
+
+  for (tChannelMapIterator channeliter = channels.begin (); channeliter != channels.end (); channeliter++)
+    {
+    tChannel * c = &channeliter->second;
+    if (c->bAdmin && !p->bAdmin)
+      continue;   /* don't show channels they can't join */
+    Send (p, " %s%s", str (c->name), p->channels.count (c) ? "*" : "");
+    }
+
+  Send (p, "\n");
+}	/* end of DoChannels */
+
+/* join <channel> - makes the channel if it doesn't exist yet (eg. for a guild) */
+
+void DoJoin (tPlayer * p, string sWhat)
+{
+  string name = GetWord (sWhat);
+  if (!ValidChannelName (p, name))
+    return;
+
+  tChannel * c = FindChannel (name, true);
+
+  if (!c)
+    SendMsg (p, M_CHANNEL_TOO_MANY);
+  else if (c->bAdmin && !p->bAdmin)
+    SendMsg (p, M_CHANNEL_NOT_ALLOWED, str (name));
+  else if (p->channels.count (c))
+    SendMsg (p, M_CHANNEL_ALREADY_ON, str (name));
+  else
+    {
+    SendMsg (p, M_CHANNEL_JOINED, str (name));
+    JoinChannel (p, c);
+    }
+}	/* end of DoJoin */
+
+/* leave <channel> */
+
+void DoLeave (tPlayer * p, string sWhat)
+{
+  string name = GetWord (sWhat);
+  if (!ValidChannelName (p, name))
+    return;
+
+  tChannel * c = FindChannel (name);
+
+  if (!c || !p->channels.count (c))
+    SendMsg (p, M_CHANNEL_NOT_ON, str (name));
+  else
+    {
+    LeaveChannel (p, c);
+    SendMsg (p, M_CHANNEL_LEFT, str (name));
+    }
+}	/* end of DoLeave */
+
+/* chat <channel> <something> */
+
+void DoChat (tPlayer * p, string sWhat)
+{
+  string name = GetWord (sWhat);
+  if (!ValidChannelName (p, name))
+    return;
+
+  tChannel * c = FindChannel (name);
+
+  if (!c || !p->channels.count (c))
+    SendMsg (p, M_CHANNEL_NOT_ON, str (name));
+  else if (sWhat.empty ())
+    SendMsg (p, M_CHANNEL_CHAT_WHAT, str (name));
+  else
+    PublishToChannel (c, CHANNEL_MESSAGE, str (name), str (p->playername), str (sWhat));
+}	/* end of DoChat */
+
+/* stats - how well their output is being coalesced */
+
+void DoStats (tPlayer * p)
+{
+  SendMsg (p, M_OUTPUT_STATS, p->iBytesSent, p->iSends,
+        p->iSends ? p->iBytesSent / p->iSends : 0LL);
+}	/* end of DoStats */
+
+/* creatures - how the creature simulation is keeping up */
+
+void DoCreatures (tPlayer * p)
+{
+  SendMsg (p, M_CREATURE_STATS, npcs.iCount, NPC_ROOMS, iNpcWorkers + 1,
+        iNpcTicks, iNpcLastTick, iNpcTicks ? iNpcTotalTime / iNpcTicks : 0LL,
+        iNpcWorstTick, iNpcOverruns, NPC_TICK_BUDGET);
+}	/* end of DoCreatures */
+
+/* what one memory account has, by subsystem, eg. " input 1024, output 96" */
+
+string MemoryBreakdown (const int iAccount)
+{
+  string breakdown;
+  char buf [50];
+  for (int i = 0; i < eMemSubsystems; i++)
+    if (memoryaccounts [iAccount].iBytes [i])
+      {
+      snprintf (buf, sizeof buf, "%s %s %lli", breakdown.empty () ? "" : ",",
+                memorysubsystems [i], memoryaccounts [iAccount].iBytes [i]);
+      breakdown += buf;
+      }
+  return breakdown;
+}	/* end of MemoryBreakdown */
+
+/* memory - admins only - who is using it (in this process, if sharded) */
+
+void DoMemory (tPlayer * p)
+{
+  if (!p->bAdmin)
+    {
+    SendMsg (p, M_HUH);
+    return;
+    }
+
+  SendMsg (p, M_MEMORY_TOTAL, iMemoryInUse, iMemoryPeak, iMemoryBudget, iMessagesDropped);
+  SendMsg (p, M_MEMORY_ACCOUNT, "(server)", MemoryAccountTotal (0), str (MemoryBreakdown (0)));
+
+  /* the biggest users first */
+  vector<pair<long long, tPlayer *> > users;
+  for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+    if ((*listiter)->iAccount)
+      users.push_back (make_pair (MemoryAccountTotal ((*listiter)->iAccount), *listiter));
+  sort (users.rbegin (), users.rend ());
+
+  for (size_t i = 0; i < users.size () && i < MEMORY_TOP; i++)
+    {
+    tPlayer * otherp = users [i].second;
+    const string & name = otherp->playername.empty () ? otherp->address : otherp->playername;
+    SendMsg (p, M_MEMORY_ACCOUNT, str (name), users [i].first,
+             str (MemoryBreakdown (otherp->iAccount)));
+    }
+}	/* end of DoMemory */
+
+/* language [code] - list the languages, or choose one */
+
+void DoLanguage (tPlayer * p, string sWhat)
+{
+  string code = GetWord (sWhat);
+
+  if (code.empty ())
+    {
+    SendMsg (p, M_LANGUAGE_LIST);
+    for (int i = 0; i < iLanguages; i++)
+      Send (p, " %s%s", str (languages [i].code), i == p->iLanguage ? "*" : "");
+    Send (p, "\n");
+    return;
+    }
+
+  /* the code becomes part of a file name, so be careful what we accept */
+  bool bValid = code.length () <= MAX_LANGUAGE_NAME;
+  for (string::size_type i = 0; bValid && i < code.length (); i++)
+    bValid = isalnum ((unsigned char) code [i]) || code [i] == '_';
+
+  int iLanguage = bValid ? FindLanguage (code, true) : -1;
+
+  if (iLanguage < 0)
+    SendMsg (p, M_LANGUAGE_UNKNOWN, str (code));
+  else
+    {
+    p->iLanguage = iLanguage;
+    SendMsg (p, M_LANGUAGE_CHOSEN, str (code));
+    }
+}	/* end of DoLanguage */
+
+/* process commands when player is connected */
+
+void ProcessCommand (string & sLine, tPlayer * p)
+{
+  
+  string command = GetWord (sLine);
+
+  if (command == "quit")
+    DoQuit (p);
+  else if (command == "look")
+    DoLook (p);
+  else if (command == "say")
+    DoSay (p, sLine);
+  else if (command == "tell")
+    DoTell (p, sLine);
+  else if (command == "password")
+    DoPassword (p, sLine);
+  else if (command == "channels")
+    DoChannels (p);
+  else if (command == "join")
+    DoJoin (p, sLine);
+  else if (command == "leave")
+    DoLeave (p, sLine);
+  else if (command == "chat")
+    DoChat (p, sLine);
+  else if (command == "stats")
+    DoStats (p);
+  else if (command == "language")
+    DoLanguage (p, sLine);
+  else if (command == "creatures")
+    DoCreatures (p);
+  else if (command == "memory")
+    DoMemory (p);
+  else
+    SendMsg (p, M_HUH);
+  
+}	/* end of ProcessCommand */
+
+/* process player input - check connection state, and act accordingly */
+
+void ProcessPlayerInput (string & sLine, tPlayer * p)
+{
+  tMemoryOwner owner (p->iAccount, eMemPlayer);
+
+  switch (p->connstate)
+    {
+    /* until we have name and password we must prompt them */
+    case eAwaitingName:
+      ProcessPlayerName (sLine, p);
+      break;
+      
+    case eAwaitingPassword:
+      ProcessPlayerPassword (sLine, p);
+      break;
+
+    /* if playing, everything they type is a command of some sort */
+    case ePlaying:
+      ProcessCommand (sLine, p);
+      break;
+
+    /* whoops! */
+    default:
+      fprintf (stderr, "Invalid connstate %i for connection %i\n",
+                     p->connstate, p->s);
+      break;
+    }
+}	/* end of ProcessPlayerInput */
+
+/* set up a player for a newly accepted (or handed over) socket */
+
+void AddPlayer (const int s, const struct sockaddr_in & sa, const int iProtocol)
+{
+  /* here on successful accept - make sure socket doesn't block */
+  if (fcntl (s, F_SETFL, FNDELAY) == -1)
+    {
+    perror ("fcntl on player socket");
+    close (s);
+    return;
+    }
+
+  /* players are interactive - don't hold small writes back waiting for acks */
+  int iNoDelay = 1;
+  if (setsockopt (s, IPPROTO_TCP, TCP_NODELAY, (char *) &iNoDelay, sizeof iNoDelay) == -1)
+    perror ("setsockopt TCP_NODELAY");
+
+  /* from here on, what we allocate for them is charged to them */
+  int iAccount = NewMemoryAccount ();
+  tMemoryOwner owner (iAccount, eMemPlayer);
+
+  tPlayer * p = new tPlayer;
+
+  p->iAccount = iAccount;
+  p->s = s;
+  p->address = inet_ntoa ( sa.sin_addr);
+  p->port = ntohs (sa.sin_port);
+  p->protocol = iProtocol;
+
+  static long long iConnections = 0;
+  p->iConnection = ++iConnections;
+  Trace (eTraceConnect, p->iConnection, iProtocol);
+
+  playerlist.push_back (p);
+
+  if (iShard >= 0)
+    printf ("New player accepted by shard %i on socket %i, from address %s, port %i\n",
+            iShard, s, str (p->address), p->port);
+  else
+    printf ("New player accepted on socket %i, from address %s, port %i\n",
+            s, str (p->address), p->port);
+
+  /* browsers get the welcome once they have upgraded to WebSocket */
+  if (p->protocol == eTelnet)
+    {
+    SendMsg (p, M_INITIAL_STRING);
+    SendMsg (p, M_TELL_NAME);
+    }
+
+}	/* end of AddPlayer */
+
+/* new player has connected */
+
+void ProcessNewConnection (const int iListener, const int iProtocol)
+  {
+  static struct sockaddr_in sa;
+  socklen_t sa_len = sizeof sa;		
+
+  int s;		/* incoming socket */
+
+  /* loop until all outstanding connections are accepted */
+  while (true)
+    {
+    s = accept ( iListener, (struct sockaddr *) &sa, &sa_len);
+
+    /* a bad socket probably means no more connections are outstanding */
+    if (s == NO_SOCKET)
+      {
+
+      /* blocking is OK - we have accepted all outstanding connections */
+      if ( errno == EWOULDBLOCK )
+        return;
+
+      perror ("accept");
+      return;
+      }
+
+    /* TODO: you might immediately close sockets if they are from an address
+      which is not acceptable (eg. spammers) */
+
+    AddPlayer (s, sa, iProtocol);
+
+    } /* end of processing *all* new connections */
+
+  } /* end of ProcessNewConnection */
+
+/* sharded mode - the router has handed us one or more new connections */
+
+void ProcessHandoff (void)
+{
+  tHandoff handoff;
+  char control [CMSG_SPACE (sizeof (int))];
+
+  for ( ; ; )
+    {
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof handoff;
+    memset (&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    int nRead = recvmsg (iHandoff, &msg, 0);
+    if (nRead == -1)
+      {
+      if (errno != EWOULDBLOCK && errno != EINTR)
+        perror ("recvmsg on handoff socket");
+      return;
+      }
+
+    /* zero means the router has gone */
+    if (nRead == 0)
+      {
+      bStopNow = 1;
+      return;
+      }
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+      {
+      fprintf (stderr, "Handoff without a socket attached\n");
+      continue;
+      }
+
+    int s;
+    memcpy (&s, CMSG_DATA (cmsg), sizeof s);
+
+    if (nRead != sizeof handoff)
+      {
+      fprintf (stderr, "Bad handoff message, length %i\n", nRead);
+      close (s);
+      continue;
+      }
+
+    AddPlayer (s, handoff.sa, handoff.iProtocol);
+    }
+}	/* end of ProcessHandoff */
+
+/* sharded mode - act on one frame the router has sent us */
+
+void ProcessBusFrame (const int iType, const string & body)
+{
+  string::size_type pos = 0;
+  string s1, s2, s3;
+
+  if (!GetString (body, pos, s1) ||
+      !GetString (body, pos, s2) ||
+      !GetString (body, pos, s3))
+    {
+    fprintf (stderr, "Malformed message bus frame, type %i\n", iType);
+    return;
+    }
+
+  switch (iType)
+    {
+    case eBusJoin:
+      remoteplayers.insert (s1);
+      SendToLocal (NULL, M_PLAYER_JOINED, s1);
+      break;
+
+    case eBusLeave:
+      if (remoteplayers.erase (s1))
+        SendToLocal (NULL, M_PLAYER_LEFT, s1);
+      break;
+
+    /* someone on another shard got the name first - start them again */
+    case eBusJoinRefused:
+      {
+      tPlayer * p = FindPlayer (str (s1));
+      if (!p || p->connstate != ePlaying)
+        break;
+      printf ("Player %s is already playing on another shard\n", str (s1));
+      SendToLocal (p, M_PLAYER_LEFT, p->playername);
+      LeaveAllChannels (p);
+      SendMsg (p, M_ALREADY_CONNECTED, str (p->playername));
+      SendMsg (p, M_TELL_NAME);
+      p->playername.erase ();
+      p->bAdmin = false;
+      p->connstate = eAwaitingName;
+      }
+      break;
+
+    case eBusBroadcast:
+      {
+      int iMsg = atoi (str (s1));
+      if (iMsg >= 0 && iMsg < eMessageCount)
+        SendToLocal (NULL, iMsg, s2, s3);
+      }
+      break;
+
+    /* s1 is the channel, s2 the message */
+    case eBusChannel:
+      {
+      tChannel * c = FindChannel (s1);		/* nobody here is on it if we don't have it */
+      if (c)
+        DeliverToChannel (c, str (s2));
+      }
+      break;
+
+    /* s1 is who it is from, s2 who it is to, s3 what they said */
+    case eBusTell:
+      {
+      tPlayer * ptarget = FindPlayer (str (s2));
+      if (ptarget)
+        {
+        SendMsg (ptarget, M_SOMEONE_TELLS, str (s1), str (s3));
+        BusSend (eBusTellOk, s1, s2, s3);
+        }
+      else
+        BusSend (eBusTellFailed, s1, s2, s3);
+      }
+      break;
+
+    /* the sender might have left by the time the reply arrives */
+    case eBusTellOk:
+    case eBusTellFailed:
+      {
+      tPlayer * p = FindPlayer (str (s1));
+      if (!p)
+        break;
+      if (iType == eBusTellOk)
+        SendMsg (p, M_YOU_TELL, str (s2), str (s3));
+      else
+        SendMsg (p, M_NOT_CONNECTED, str (s2));
+      }
+      break;
+
+    default:
+      fprintf (stderr, "Unknown message bus frame, type %i\n", iType);
+      break;
+    }
+}	/* end of ProcessBusFrame */
+
+/* sharded mode - read and act on frames from the router */
+
+void ProcessBusRead (void)
+{
+  if (!BusRead (iBus, sBusIn))
+    {
+    fprintf (stderr, "Shard %i lost its connection to the router\n", iShard);
+    bStopNow = 1;
+    }
+
+  int iType;
+  string body;
+  while (BusNextFrame (sBusIn, iType, body))
+    ProcessBusFrame (iType, body);
+}	/* end of ProcessBusRead */
+
+void ProcessException (tPlayer * p)
+{
+  fprintf (stderr, "Exception on socket %i\n", p->s);
+
+  /* signals can cause exceptions, don't get too excited. :) */
+}	/* end of ProcessException */
+
+/*---------------------------------------------- */
+/*  WebSocket - so web browsers can play */
+/*---------------------------------------------- */
+
+/* A browser connects to WEB_PORT and sends an HTTP request asking to upgrade
+   to WebSocket (RFC 6455). After that, what it types arrives in masked frames,
+   which we unmask and add to inbuf so the rest of the server sees lines just as
+   it does from telnet. Output goes back as binary frames, one frame per writev
+   in ProcessWrite, made up of a small header plus the same shared strings a
+   telnet player would be sent. A plain request for a page gets a tiny web
+   client, so pointing a browser at http://localhost:4001/ is enough to play. */
+
+#define WEB_CLIENT_PAGE \
+  "<!DOCTYPE html><html><head><title>Tiny MUD Server</title></head><body>\n" \
+  "<pre id=out></pre><input id=in size=80 autofocus>\n" \
+  "<script>\n" \
+  "var out = document.getElementById ('out'), inp = document.getElementById ('in');\n" \
+  "var decoder = new TextDecoder (), ws = new WebSocket ('ws://' + location.host + '/');\n" \
+  "ws.binaryType = 'arraybuffer';\n" \
+  "ws.onmessage = function (e) { out.textContent += decoder.decode (e.data); scrollTo (0, document.body.scrollHeight); };\n" \
+  "ws.onclose = function () { out.textContent += '\\n[disconnected]\\n'; };\n" \
+  "inp.onkeydown = function (e) { if (e.key == 'Enter') { ws.send (inp.value); inp.value = ''; } };\n" \
+  "</script></body></html>\n"
+
+/* SHA-1 of a string, as 20 raw bytes - only needed for the upgrade handshake */
+
+string Sha1 (const string & message)
+{
+  uint32_t h [5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+  /* pad to a multiple of 64 bytes, ending with the length in bits */
+  string m = message;
+  m += (char) 0x80;
+  while (m.length () % 64 != 56)
+    m += (char) 0;
+  uint64_t iBits = (uint64_t) message.length () * 8;
+  for (int i = 7; i >= 0; i--)
+    m += (char) (iBits >> (i * 8));
+
+  #define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+  for (string::size_type iChunk = 0; iChunk < m.length (); iChunk += 64)
+    {
+    uint32_t w [80];
+    for (int i = 0; i < 16; i++)
+      w [i] = (uint32_t) (unsigned char) m [iChunk + i * 4] << 24 |
+              (uint32_t) (unsigned char) m [iChunk + i * 4 + 1] << 16 |
+              (uint32_t) (unsigned char) m [iChunk + i * 4 + 2] << 8 |
+              (uint32_t) (unsigned char) m [iChunk + i * 4 + 3];
+    for (int i = 16; i < 80; i++)
+      w [i] = ROL (w [i - 3] ^ w [i - 8] ^ w [i - 14] ^ w [i - 16], 1);
+
+    uint32_t a = h [0], b = h [1], c = h [2], d = h [3], e = h [4];
+    for (int i = 0; i < 80; i++)
+      {
+      uint32_t f, k;
+      if (i < 20)
+        f = (b & c) | (~b & d), k = 0x5A827999;
+      else if (i < 40)
+        f = b ^ c ^ d, k = 0x6ED9EBA1;
+      else if (i < 60)
+        f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+      else
+        f = b ^ c ^ d, k = 0xCA62C1D6;
+      uint32_t temp = ROL (a, 5) + f + e + k + w [i];
+      e = d;
+      d = c;
+      c = ROL (b, 30);
+      b = a;
+      a = temp;
+      }
+
+    h [0] += a; h [1] += b; h [2] += c; h [3] += d; h [4] += e;
+    }
+
+  #undef ROL
+
+  string digest;
+  for (int i = 0; i < 20; i++)
+    digest += (char) (h [i / 4] >> (24 - (i % 4) * 8));
+  return digest;
+}	/* end of Sha1 */
+
+/* base-64 encoding of a string */
+
+string Base64 (const string & data)
+{
+  static const char * digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string encoded;
+
+  for (string::size_type i = 0; i < data.length (); i += 3)
+    {
+    uint32_t n = (unsigned char) data [i] << 16;
+    if (i + 1 < data.length ())
+      n |= (unsigned char) data [i + 1] << 8;
+    if (i + 2 < data.length ())
+      n |= (unsigned char) data [i + 2];
+
+    encoded += digits [(n >> 18) & 63];
+    encoded += digits [(n >> 12) & 63];
+    encoded += i + 1 < data.length () ? digits [(n >> 6) & 63] : '=';
+    encoded += i + 2 < data.length () ? digits [n & 63] : '=';
+    }
+
+  return encoded;
+}	/* end of Base64 */
+
+/* value of a header in an HTTP request (name in lower case), empty if not there */
+
+string HttpHeader (const string & request, const char * name)
+{
+  string::size_type iStart = request.find ("\r\n");		/* skip the request line */
+
+  while (iStart != string::npos)
+    {
+    iStart += 2;
+    string::size_type iEnd = request.find ("\r\n", iStart);
+    if (iEnd == string::npos)
+      break;
+
+    string::size_type iColon = request.find (':', iStart);
+    if (iColon != string::npos && iColon < iEnd)
+      {
+      string header (request, iStart, iColon - iStart);
+      for (string::size_type i = 0; i < header.length (); i++)
+        header [i] = tolower ((unsigned char) header [i]);
+
+      if (header == name)
+        {
+        string value (request, iColon + 1, iEnd - iColon - 1);
+        Trim (value);
+        return value;
+        }
+      }
+
+    iStart = iEnd;
+    }
+
+  return "";
+}	/* end of HttpHeader */
+
+/* write straight to the socket, bypassing outbuf - only for the handshake
+   response, before anything else can have been queued */
+
+bool WriteRaw (tPlayer * p, const string & data)
+{
+  string::size_type iDone = 0;
+  while (iDone < data.length ())
+    {
+    int nWrite = write (p->s, data.data () + iDone, data.length () - iDone);
+    if (nWrite <= 0)
+      return false;
+    iDone += nWrite;
+    }
+  p->iSends++;
+  p->iBytesSent += data.length ();
+  return true;
+}	/* end of WriteRaw */
+
+/* a WebSocket frame header for a payload of this length (we never mask) */
+
+string WebSocketHeader (const int iOpcode, const uint64_t iLength)
+{
+  string header;
+  header += (char) (0x80 | iOpcode);	/* FIN - we never fragment */
+
+  if (iLength < 126)
+    header += (char) iLength;
+  else if (iLength < 65536)
+    {
+    header += (char) 126;
+    header += (char) (iLength >> 8);
+    header += (char) iLength;
+    }
+  else
+    {
+    header += (char) 127;
+    for (int i = 7; i >= 0; i--)
+      header += (char) (iLength >> (i * 8));
+    }
+
+  return header;
+}	/* end of WebSocketHeader */
+
+/* Queue a control frame (pong, close). It can't go in the middle of a data
+   frame, so it goes straight after the iFramed items that make up the frame
+   being sent (if any), and counts as framed itself - anything queued after it
+   gets a frame of its own as usual. */
+
+void WebSocketControl (tPlayer * p, const int iOpcode, const string & payload)
+{
+  if (p->s == NO_SOCKET)
+    return;
+
+  tMemoryOwner owner (p->iAccount, eMemOutput);
+  tTextList::iterator textiter = p->outbuf.begin ();
+  advance (textiter, p->iFramed);
+  p->outbuf.insert (textiter, make_shared<const string>
+                    (WebSocketHeader (iOpcode, payload.length ()) + payload));
+  p->iFramed++;
+}	/* end of WebSocketControl */
+
+/* Put a header in front of what is waiting in outbuf, making it into one frame.
+   The strings themselves are not copied - the header is just one more item in
+   the list, so writev sends header and text together. */
+
+void WebSocketFrame (tPlayer * p)
+{
+  uint64_t iLength = 0;
+  int iCount = 0;
+
+  for (tTextList::iterator textiter = p->outbuf.begin ();
+       textiter != p->outbuf.end () && iCount < MAX_IOV - 1; textiter++, iCount++)
+    iLength += (*textiter)->length ();
+
+  p->outbuf.push_front (make_shared<const string> (WebSocketHeader (2, iLength)));
+  p->iFramed = iCount + 1;
+}	/* end of WebSocketFrame */
+
+/* Undo the client's masking, in place. The 4-byte mask repeats, so we XOR 8
+   bytes at a time with it doubled up (which the compiler turns into vector
+   instructions), then finish off any odd bytes at the end. */
+
+void Unmask (unsigned char * data, const size_t iLength, const unsigned char * mask)
+{
+  unsigned char mask8 [8];
+  memcpy (mask8, mask, 4);
+  memcpy (mask8 + 4, mask, 4);
+
+  uint64_t iMask;
+  memcpy (&iMask, mask8, sizeof iMask);
+
+  size_t i = 0;
+  for ( ; i + 8 <= iLength; i += 8)
+    {
+    uint64_t iWord;
+    memcpy (&iWord, data + i, sizeof iWord);
+    iWord ^= iMask;
+    memcpy (data + i, &iWord, sizeof iWord);
+    }
+
+  for ( ; i < iLength; i++)
+    data [i] ^= mask [i & 3];
+}	/* end of Unmask */
+
+/* take whatever frames have arrived, and add their text to inbuf - each
+   message from the browser is one line */
+
+void WebSocketRead (tPlayer * p, const char * data, const size_t iLength)
+{
+  p->wsbuf.append (data, iLength);
+
+  string::size_type iPos = 0;
+  while (p->s != NO_SOCKET && p->wsbuf.length () - iPos >= 2)
+    {
+    unsigned char * frame = (unsigned char *) &p->wsbuf [iPos];
+    size_t iAvailable = p->wsbuf.length () - iPos;
+    bool bFin = frame [0] & 0x80;
+    int iOpcode = frame [0] & 0x0F;
+    uint64_t iPayload = frame [1] & 0x7F;
+    size_t iHeader = 2;
+
+    if (iPayload == 126)
+      {
+      if (iAvailable < 4)
+        break;
+      iPayload = frame [2] << 8 | frame [3];
+      iHeader = 4;
+      }
+    else if (iPayload == 127)
+      {
+      if (iAvailable < 10)
+        break;
+      iPayload = 0;
+      for (int i = 2; i < 10; i++)
+        iPayload = iPayload << 8 | frame [i];
+      iHeader = 10;
+      }
+
+    /* browsers must mask, and we don't take more than a line's worth at a time */
+    if (!(frame [1] & 0x80) || iPayload > MAX_INPUT_LINE)
+      {
+      fprintf (stderr, "Bad WebSocket frame from connection %i\n", p->s);
+      DoQuit (p);
+      return;
+      }
+
+    if (iAvailable < iHeader + 4 + iPayload)
+      break;		/* wait for the rest */
+
+    unsigned char * payload = frame + iHeader + 4;
+    Unmask (payload, iPayload, frame + iHeader);
+
+    switch (iOpcode)
+      {
+      case 0:   /* continuation */
+      case 1:   /* text */
+      case 2:   /* binary */
+        p->inbuf.append ((const char *) payload, iPayload);
+        if (bFin && (p->inbuf.empty () || p->inbuf [p->inbuf.length () - 1] != '\n'))
+          p->inbuf += '\n';
+        break;
+
+      case 8:   /* close */
+        DoQuit (p);
+        return;
+
+      case 9:   /* ping */
+        WebSocketControl (p, 10, string ((const char *) payload, iPayload));
+        break;
+
+      case 10:  /* pong */
+        break;
+
+      default:
+        fprintf (stderr, "Unknown WebSocket opcode %i from connection %i\n", iOpcode, p->s);
+        break;
+      }
+
+    iPos += iHeader + 4 + iPayload;
+    }
+
+  p->wsbuf.erase (0, iPos);
+}	/* end of WebSocketRead */
+
+/* waiting for the browser's upgrade request - it is collected in inbuf */
+
+void WebSocketHandshake (tPlayer * p)
+{
+  string::size_type iEnd = p->inbuf.find ("\r\n\r\n");
+
+  if (iEnd == string::npos)
+    {
+    if (p->inbuf.length () > MAX_HTTP_REQUEST)
+      ClosePlayer (p);
+    return;
+    }
+
+  string request (p->inbuf, 0, iEnd + 2);
+  string rest (p->inbuf, iEnd + 4);
+  p->inbuf.erase ();
+
+  string key = HttpHeader (request, "sec-websocket-key");
+  string upgrade = HttpHeader (request, "upgrade");
+  for (string::size_type i = 0; i < upgrade.length (); i++)
+    upgrade [i] = tolower ((unsigned char) upgrade [i]);
+
+  /* not an upgrade - give them the web client, or an error */
+  if (key.empty () || upgrade != "websocket")
+    {
+    if (request.compare (0, 4, "GET ") == 0)
+      {
+      char sLength [20];
+      snprintf (sLength, sizeof sLength, "%i", (int) strlen (WEB_CLIENT_PAGE));
+      WriteRaw (p, string ("HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/html; charset=utf-8\r\n"
+                           "Connection: close\r\n"
+                           "Content-Length: ") + sLength + "\r\n\r\n" + WEB_CLIENT_PAGE);
+      }
+    else
+      WriteRaw (p, "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n");
+    ClosePlayer (p);
+    return;
+    }
+
+  if (!WriteRaw (p, "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: " + Base64 (Sha1 (key + WEBSOCKET_GUID)) + "\r\n\r\n"))
+    {
+    ClosePlayer (p);
+    return;
+    }
+
+  p->protocol = eWebSocket;
+  printf ("Connection %i upgraded to WebSocket\n", p->s);
+
+  SendMsg (p, M_INITIAL_STRING);
+  SendMsg (p, M_TELL_NAME);
+
+  /* the browser may have sent its first frame already */
+  if (!rest.empty ())
+    WebSocketRead (p, rest.data (), rest.length ());
+}	/* end of WebSocketHandshake */
+
+/* one line the player typed (called by SplitLines) */
+
+void ProcessLine (string & sLine, void * context)
+{
+  tPlayer * p = (tPlayer *) context;
+
+  /* they quit (or were disconnected) on an earlier line - ignore the rest */
+  if (p->s == NO_SOCKET)
+    return;
+
+  Trace (p->connstate == ePlaying ? eTraceInput : eTraceLogin,
+         p->iConnection, sLine.length (), sLine);
+  ProcessPlayerInput (sLine, p);  /* now, do something with it */
+}	/* end of ProcessLine */
+
+/* Here when there is outstanding data to be read for this player */
+
+void ProcessRead (tPlayer * p)
+{
+  tMemoryOwner owner (p->iAccount, eMemInput);
+  int nRead;
+  static char buf [1000];
+
+  nRead = read(p->s, buf, sizeof(buf) - 1 );
+  
+  if (nRead == -1)
+    {
+    if (errno != EWOULDBLOCK)
+      perror ("read from player");
+    return;
+    }
+
+  if (nRead == 0)
+    {
+    fprintf (stderr, "Connection %i closed\n", p->s);
+    DoQuit (p);		// tell other players he has gone
+    return;
+    }
+
+  switch (p->protocol)
+    {
+    case eWebSocketHandshake:
+      p->inbuf.append (buf, nRead);
+      WebSocketHandshake (p);
+      if (p->protocol != eWebSocket)
+        return;
+      break;		/* any frames that came with the request are now in inbuf */
+
+    case eWebSocket:
+      WebSocketRead (p, buf, nRead);		/* unwrap the frames into inbuf */
+      break;
+
+    default:
+      p->inbuf.append (buf, nRead);		/* add to input buffer (it may contain NULs) */
+      break;
+    }
+
+  /* a close frame (or a bad one) has disconnected them - nothing more to do */
+  if (p->s == NO_SOCKET)
+    return;
+
+  /* try to extract lines from the input buffer */
+  if (SplitLines (p->inbuf, p->bSkipLine, ProcessLine, p))
+    SendMsg (p, M_INPUT_TOO_LONG, MAX_INPUT_LINE);
+    
+}	/* end of ProcessRead */
+
+/* turn TCP_CORK on or off for a socket, true if it worked */
+
+bool SetCork (const int s, const int iCork)
+{
+  if (setsockopt (s, IPPROTO_TCP, TCP_CORK, (char *) &iCork, sizeof iCork) == -1)
+    {
+    perror ("setsockopt TCP_CORK");
+    return false;
+    }
+  return true;
+}	/* end of SetCork */
+
+/* Here when we can send stuff to the player. We are allowing for large
+ volumes of output that might not be sent all at once, so whatever cannot
+ go this time stays in the list of outstanding strings for this player.
+
+ Everything queued for the player since last time (eg. a prompt, a tick message
+ and all the pieces of a "look") goes out in a single writev, so it normally
+ reaches them as one packet rather than one per string. */
+
+void ProcessWrite (tPlayer * p)
+{
+  /* nothing goes to a browser until it has upgraded to WebSocket */
+  if (p->protocol == eWebSocketHandshake)
+    return;
+
+  struct iovec iov [MAX_IOV];
+
+  /* for bulk output, cork the socket so the kernel only sends full packets,
+     even if it takes several writev calls to get through the list */
+  bool bCorked = false;
+
+  /* we will loop attempting to write all in buffer, until write blocks */
+  while (p->s != NO_SOCKET && !p->outbuf.empty ())
+    {
+
+    /* a browser gets a frame header in front of each batch */
+    if (p->protocol == eWebSocket && p->iFramed == 0)
+      WebSocketFrame (p);
+
+    /* gather up to MAX_IOV outstanding strings - the first may have been
+      partly sent already, and they may be shared with other players, so
+      rather than changing them we remember how much of the first has gone */
+    int iCount = 0;
+    size_t iLength = 0;
+    for (tTextList::iterator textiter = p->outbuf.begin ();
+         textiter != p->outbuf.end () && iCount < MAX_IOV &&
+         (p->protocol != eWebSocket || iCount < p->iFramed); textiter++, iCount++)
+      {
+      const string & text = **textiter;
+      string::size_type iSkip = iCount == 0 ? p->iOutSent : 0;
+      iov [iCount].iov_base = (void *) (text.data () + iSkip);
+      iov [iCount].iov_len = text.length () - iSkip;
+      iLength += iov [iCount].iov_len;
+      }
+
+    if (!bCorked && CORK_BYTES > 0 &&
+        (iLength >= CORK_BYTES || iCount < (int) p->outbuf.size ()))
+      bCorked = SetCork (p->s, 1);
+
+    /* send to player */
+    int nWrite = writev (p->s, iov, iCount);
+
+    /* check for bad write */
+    if (nWrite < 0)
+      {
+      if (errno != EWOULDBLOCK )
+        perror ("send to player");	/* some other error? */
+
+      /* write would block - leave it all on the queue */
+      break;
+      }
+
+    p->iSends++;
+    p->iBytesSent += nWrite;
+
+    /* drop the strings that have gone completely */
+    size_t iWritten = nWrite;
+    while (!p->outbuf.empty () &&
+           iWritten >= p->outbuf.front ()->length () - p->iOutSent)
+      {
+      iWritten -= p->outbuf.front ()->length () - p->iOutSent;
+      p->outbuf.pop_front ();
+      p->iOutSent = 0;
+      if (p->iFramed > 0)
+        p->iFramed--;
+      }
+
+    /* if partial write, leave the rest on the queue, and exit */
+    if (nWrite < (int) iLength)
+      {
+      p->iOutSent += iWritten;
+      break;
+      } /* end of partial write */
+
+    } /* end of having write loop */
+
+  /* removing the cork pushes out whatever is left as a final, short packet */
+  if (bCorked && p->s != NO_SOCKET)
+    SetCork (p->s, 0);
+
+}		/* end of ProcessWrite */
+
+/* main processing loop */
+
+/* shed load if we are using too much memory - called every pass of the main loop */
+
+void CheckMemoryBudget (void)
+{
+  bool bWasShort = bMemoryShort;
+  bMemoryShort = iMemoryInUse > iMemoryBudget / 100 * MEMORY_SOFT_PERCENT;
+  if (bMemoryShort != bWasShort)
+    printf ("%lli bytes of memory in use - %s player chatter\n",
+            iMemoryInUse, bMemoryShort ? "dropping" : "resuming");
+
+  bool bWasOver = bServerOverBudget;
+  bServerOverBudget = false;
+
+  if (iMemoryInUse <= iMemoryBudget)
+    return;
+
+  /* disconnect whoever is using the most - they are deleted (and their memory
+     freed) next time around, then we see if that was enough */
+  tPlayer * worstp = NULL;
+  long long iWorst = 0;
+  for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+    {
+    tPlayer * p = *listiter;
+    if (p->s != NO_SOCKET && p->iAccount && MemoryAccountTotal (p->iAccount) > iWorst)
+      {
+      worstp = p;
+      iWorst = MemoryAccountTotal (p->iAccount);
+      }
+    }
+
+  /* but only if the connections are to blame - if it is the server's own
+     memory (creatures, channels, the world) that is over, disconnecting people
+     won't help, unless one of them is using a lot */
+  long long iOver = iMemoryInUse - iMemoryBudget;
+  long long iConnections = iMemoryInUse - MemoryAccountTotal (0);
+  if (worstp && (iConnections >= iOver || iWorst > MEMORY_SHED_FLOOR))
+    {
+    printf ("%lli bytes of memory in use, over the budget of %lli - "
+            "disconnecting socket %i (%s), which is using %lli bytes\n",
+            iMemoryInUse, iMemoryBudget, worstp->s, str (worstp->playername), iWorst);
+    DisconnectPlayer (worstp);
+    return;
+    }
+
+  /* just say so, once */
+  bServerOverBudget = true;
+  if (!bWasOver)
+    printf ("%lli bytes of memory in use, over the budget of %lli - "
+            "connections are only using %lli of it, not disconnecting anyone\n",
+            iMemoryInUse, iMemoryBudget, iConnections);
+}	/* end of CheckMemoryBudget */
+
+void MainLoop (void)
+{
+
+fd_set in_set;
+fd_set out_set;
+fd_set exc_set;
+int iMaxdesc;
+
+struct timeval timeout;
+tPlayerListIterator listiter;
+  
+  /* loop processing input, output, events */
+
+  do
+    {
+
+    /* We will go through this loop roughly every COMMS_WAIT_SEC/COMMS_WAIT_USEC
+      seconds (at present 0.5 seconds).
+      Thus, this is a good place to put periodic processing (eg. fights,
+      weather, random events etc.).
+      The example below just sends a message every MESSAGE_INTERVAL seconds.
+      */
+    
+    /* send new command if it is time */
+    if (time (NULL) > (tLastMessage + MESSAGE_INTERVAL))
+      {
+      SendToLocal (NULL, M_TICK_MESSAGE);  /* other shards have their own tick */
+      tLastMessage = time (NULL);
+      }
+
+    /* the creatures do their thing */
+    NpcTick ();
+  
+    /* delete players who have closed their comms - have to do it outside other loops to avoid */
+    /* access violations (iterating loops that have had items removed) */
+    for (listiter = playerlist.begin (); listiter != playerlist.end (); )
+      {
+      tPlayer * p = *listiter;
+
+      if (p->s == NO_SOCKET)
+        {
+        Trace (eTraceClose, p->iConnection, p->iBytesSent);
+        LeaveAllChannels (p);
+        delete p;
+        playerlist.erase (listiter);
+        listiter = playerlist.begin ();		/* list iteration is no longer valid */
+        }
+      else
+        listiter++;
+      }	/* end of looping through players */
+    
+    /* are we using too much memory? */
+    CheckMemoryBudget ();
+
+    /* new message catalogs? */
+    if (bReloadMessages)
+      ReloadLanguages ();
+
+    /* commit this time around's journal records, and snapshot if it is time */
+    PeriodicSave ();
+    TraceFlush ();
+
+    /* send everything queued for the message bus this time around in one go */
+    if (iBus != NO_SOCKET && !BusWrite (iBus, sBusOut))
+      bStopNow = 1;
+
+    /* get ready for "select" function ... */
+
+    FD_ZERO (&in_set);
+    FD_ZERO (&out_set);
+    FD_ZERO (&exc_set);
+    iMaxdesc = 0;
+
+    /* add our control socket (shards get connections from the router instead) */
+    if (iControl != NO_SOCKET)
+      {
+      FD_SET (iControl, &in_set);
+      FD_SET (iWebControl, &in_set);
+      iMaxdesc	= UMAX (iControl, iWebControl);
+      }
+
+    /* sharded mode - listen to the router */
+    if (iBus != NO_SOCKET)
+      {
+      FD_SET (iBus, &in_set);
+      FD_SET (iHandoff, &in_set);
+      if (!sBusOut.empty ())
+        FD_SET (iBus, &out_set);
+      iMaxdesc = UMAX (iMaxdesc, UMAX (iBus, iHandoff));
+      }
+
+    /* loop through all connections, adding them to the descriptor set */
+    for (listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+      {
+      tPlayer * p = *listiter;
+
+      /* don't bother if connection is closed */
+      if (p->s != NO_SOCKET)
+        {
+        iMaxdesc = UMAX (iMaxdesc, p->s);
+        FD_SET( p->s, &in_set  );
+        FD_SET( p->s, &exc_set );
+
+        /* we are only interested in writing to sockets we have something for */
+        if (!p->outbuf.empty () && p->protocol != eWebSocketHandshake)
+          FD_SET( p->s, &out_set );
+        }	/* end of active player */
+
+      }	/* end of looping through players */
+    
+    timeout.tv_sec = COMMS_WAIT_SEC;
+    timeout.tv_usec = COMMS_WAIT_USEC;  /* time to wait before timing out */
+
+    if (select (iMaxdesc + 1, &in_set, &out_set, &exc_set, &timeout) == 0)
+      continue;		/* time  limit expired? - nothing to do this time */
+
+    /* New connection on control port? */
+    if (iControl != NO_SOCKET && FD_ISSET (iControl, &in_set))
+      ProcessNewConnection (iControl, eTelnet);
+
+    /* or on the web port? */
+    if (iWebControl != NO_SOCKET && FD_ISSET (iWebControl, &in_set))
+      ProcessNewConnection (iWebControl, eWebSocketHandshake);
+
+    /* sharded mode - new connections and messages from the router */
+    if (iBus != NO_SOCKET)
+      {
+      if (FD_ISSET (iHandoff, &in_set))
+        ProcessHandoff ();
+      if (FD_ISSET (iBus, &in_set))
+        ProcessBusRead ();
+      }
+
+    /* loop through all players */
+    for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+      {
+      tPlayer * p = *listiter;
+       
+      /* handle exceptions */
+      if (p->s != NO_SOCKET && FD_ISSET (p->s, &exc_set))
+        ProcessException (p);
+
+      /* look for ones we can read from, provided they aren't closed */
+      if (p->s != NO_SOCKET && FD_ISSET (p->s, &in_set))
+        ProcessRead (p);
+
+      }   /* end of looping looking through all players */
+
+    /* what those commands changed is on disk before anyone hears about it */
+    JournalFlush ();
+
+    for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+      {
+      tPlayer * p = *listiter;
+
+      /* look for ones we can write to, provided they aren't closed */
+      if (p->s != NO_SOCKET && FD_ISSET (p->s, &out_set))
+        ProcessWrite (p);
+ 
+      }   /* end of looping looking through all players */
+
+    }  while (!bStopNow); 	/* end of looping processing input */
+
+}		/* end of MainLoop */
+
+/*---------------------------------------------- */
+/*  router - the parent process in sharded mode */
+/*---------------------------------------------- */
+
+/* the router's view of one shard process */
+
+class tShard
+{
+public:
+  pid_t pid;					/* process id of the shard */
+  int s;							/* message bus socket, NO_SOCKET if the shard has gone */
+  int handoff;				/* socket we pass new connections down */
+  string inbuf;				/* partial frames from the shard */
+  string outbuf;			/* frames waiting to go to the shard */
+
+  tShard ()	/* constructor */
+    {
+    pid = 0;
+    s = NO_SOCKET;
+    handoff = NO_SOCKET;
+    };
+};
+
+tShard shards [MAX_SHARDS];
+int iShards = 0;		/* how many shards we started */
+
+/* which shard each playing player is on */
+map<string, int> shardofplayer;
+
+/* fork the shard processes - returns -1 on error, otherwise 0 in both the
+   router and the shards (iShard tells them apart) */
+
+int StartShards (const int iCount)
+{
+  /* don't let the children inherit (and repeat) our buffered output */
+  fflush (stdout);
+  fflush (stderr);
+
+  for (iShards = 0; iShards < iCount; iShards++)
+    {
+    int bus [2];
+    int handoff [2];
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, bus) == -1 ||
+        socketpair (AF_UNIX, SOCK_DGRAM, 0, handoff) == -1)
+      {
+      perror ("socketpair for shard");
+      return -1;
+      }
+
+    if (fcntl (bus [0], F_SETFL, FNDELAY) == -1 ||
+        fcntl (bus [1], F_SETFL, FNDELAY) == -1 ||
+        fcntl (handoff [0], F_SETFL, FNDELAY) == -1 ||
+        fcntl (handoff [1], F_SETFL, FNDELAY) == -1)
+      {
+      perror ("fcntl on shard socket");
+      return -1;
+      }
+
+    pid_t pid = fork ();
+
+    if (pid == -1)
+      {
+      perror ("fork");
+      return -1;
+      }
+
+    /* child - we become a shard, with no listening socket of our own */
+    if (pid == 0)
+      {
+      for (int i = 0; i < iShards; i++)
+        {
+        close (shards [i].s);
+        close (shards [i].handoff);
+        }
+      close (bus [0]);
+      close (handoff [0]);
+      close (iControl);
+      close (iWebControl);
+      iControl = NO_SOCKET;
+      iWebControl = NO_SOCKET;
+
+      iShard = iShards;
+      iBus = bus [1];
+      iHandoff = handoff [1];
+      printf ("Shard %i started, process %i\n", iShard, (int) getpid ());
+      return 0;
+      }
+
+    /* parent - remember how to talk to it */
+    close (bus [1]);
+    close (handoff [1]);
+    shards [iShards].pid = pid;
+    shards [iShards].s = bus [0];
+    shards [iShards].handoff = handoff [0];
+    }
+
+  return 0;
+}	/* end of StartShards */
+
+/* pass a connection we accepted down to a shard, false if it couldn't take it */
+
+bool HandOff (tShard & shard, int s, struct sockaddr_in & sa, const int iProtocol)
+{
+  char control [CMSG_SPACE (sizeof (int))];
+  struct iovec iov;
+  struct msghdr msg;
+  tHandoff handoff;
+
+  handoff.sa = sa;
+  handoff.iProtocol = iProtocol;
+
+  memset (control, 0, sizeof control);
+  iov.iov_base = &handoff;
+  iov.iov_len = sizeof handoff;
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof s);
+  memcpy (CMSG_DATA (cmsg), &s, sizeof s);
+
+  if (sendmsg (shard.handoff, &msg, 0) == -1)
+    {
+    perror ("sendmsg on handoff socket");
+    return false;
+    }
+
+  return true;
+}	/* end of HandOff */
+
+/* collect the exit status of a shard that has gone, if it has finished */
+
+void ReapShard (tShard & shard)
+{
+  if (shard.pid > 0 && waitpid (shard.pid, NULL, WNOHANG) != 0)
+    shard.pid = 0;
+}	/* end of ReapShard */
+
+/* a shard has gone away - forget its players, and tell the other shards */
+
+void ShardLost (const int iWhich)
+{
+  tShard & shard = shards [iWhich];
+
+  if (shard.s == NO_SOCKET)
+    return;
+
+  fprintf (stderr, "Shard %i has gone\n", iWhich);
+  close (shard.s);
+  close (shard.handoff);
+  shard.s = NO_SOCKET;
+  shard.handoff = NO_SOCKET;
+  shard.inbuf.erase ();
+  shard.outbuf.erase ();
+  ReapShard (shard);		/* if it is still exiting, RouterLoop gets it later */
+
+  for (map<string, int>::iterator mapiter = shardofplayer.begin (); mapiter != shardofplayer.end (); )
+    {
+    if (mapiter->second != iWhich)
+      {
+      mapiter++;
+      continue;
+      }
+
+    string body;
+    PutString (body, mapiter->first);
+    PutString (body, "");
+    PutString (body, "");
+    for (int i = 0; i < iShards; i++)
+      if (shards [i].s != NO_SOCKET)
+        BusQueue (shards [i].outbuf, eBusLeave, body);
+
+    shardofplayer.erase (mapiter++);
+    }
+}	/* end of ShardLost */
+
+/* route one frame that arrived from shard iFrom */
+
+void RouteFrame (const int iFrom, const int iType, const string & body)
+{
+  string::size_type pos = 0;
+  string s1, s2, s3;
+
+  if (!GetString (body, pos, s1) ||
+      !GetString (body, pos, s2) ||
+      !GetString (body, pos, s3))
+    {
+    fprintf (stderr, "Malformed message bus frame from shard %i, type %i\n", iFrom, iType);
+    return;
+    }
+
+  int iTo = -1;		/* for frames that go to just one shard, -1 for everyone else */
+
+  switch (iType)
+    {
+    /* two shards can let in the same name at once - the first join we see wins */
+    case eBusJoin:
+      {
+      map<string, int>::const_iterator mapiter = shardofplayer.find (s1);
+      if (mapiter != shardofplayer.end () && mapiter->second != iFrom)
+        {
+        BusQueue (shards [iFrom].outbuf, eBusJoinRefused, body);
+        return;
+        }
+      shardofplayer [s1] = iFrom;
+      }
+      break;
+
+    /* only the shard the name belongs to can give it up */
+    case eBusLeave:
+      {
+      map<string, int>::iterator mapiter = shardofplayer.find (s1);
+      if (mapiter == shardofplayer.end () || mapiter->second != iFrom)
+        return;
+      shardofplayer.erase (mapiter);
+      }
+      break;
+
+    case eBusBroadcast:
+    case eBusChannel:
+      break;
+
+    /* a tell goes to the shard with the target on it */
+    case eBusTell:
+      {
+      map<string, int>::const_iterator mapiter = shardofplayer.find (s2);
+      if (mapiter == shardofplayer.end () || shards [mapiter->second].s == NO_SOCKET)
+        {
+        BusQueue (shards [iFrom].outbuf, eBusTellFailed, body);
+        return;
+        }
+      iTo = mapiter->second;
+      }
+      break;
+
+    /* replies go back to the shard with the sender on it */
+    case eBusTellOk:
+    case eBusTellFailed:
+      {
+      map<string, int>::const_iterator mapiter = shardofplayer.find (s1);
+      if (mapiter == shardofplayer.end ())
+        return;   /* sender has left - nothing to do */
+      iTo = mapiter->second;
+      }
+      break;
+
+    default:
+      fprintf (stderr, "Unknown message bus frame from shard %i, type %i\n", iFrom, iType);
+      return;
+    }
+
+  if (iTo < 0)
+    {
+    for (int i = 0; i < iShards; i++)
+      if (i != iFrom && shards [i].s != NO_SOCKET)
+        BusQueue (shards [i].outbuf, iType, body);
+    }
+  else if (shards [iTo].s != NO_SOCKET)
+    BusQueue (shards [iTo].outbuf, iType, body);
+
+}	/* end of RouteFrame */
+
+/* accept new connections and share them out between the shards */
+
+void RouteNewConnections (const int iListener, const int iProtocol, int & iNext)
+{
+  static struct sockaddr_in sa;
+  socklen_t sa_len = sizeof sa;
+
+  while (true)
+    {
+    int s = accept (iListener, (struct sockaddr *) &sa, &sa_len);
+
+    if (s == NO_SOCKET)
+      {
+      if (errno != EWOULDBLOCK)
+        perror ("accept");
+      return;
+      }
+
+    /* round-robin, skipping shards that have gone */
+    bool bHandedOff = false;
+    for (int iTries = 0; iTries < iShards && !bHandedOff; iTries++)
+      {
+      tShard & shard = shards [iNext];
+      iNext = (iNext + 1) % iShards;
+      if (shard.s != NO_SOCKET)
+        bHandedOff = HandOff (shard, s, sa, iProtocol);
+      }
+
+    if (!bHandedOff)
+      fprintf (stderr, "No shard could take connection from %s\n", inet_ntoa (sa.sin_addr));
+
+    /* the shard has its own copy of the socket now */
+    close (s);
+    }
+}	/* end of RouteNewConnections */
+
+/* main loop of the router process */
+
+void RouterLoop (void)
+{
+  fd_set in_set;
+  fd_set out_set;
+  int iMaxdesc;
+  int iNext = 0;			/* next shard to get a new connection */
+  struct timeval timeout;
+
+  do
+    {
+    /* the shards have the message catalogs */
+    if (bReloadMessages)
+      {
+      bReloadMessages = 0;
+      for (int i = 0; i < iShards; i++)
+        if (shards [i].s != NO_SOCKET)
+          kill (shards [i].pid, SIGHUP);
+      }
+
+    /* send everything the shards have coming to them */
+    for (int i = 0; i < iShards; i++)
+      if (shards [i].s != NO_SOCKET && !BusWrite (shards [i].s, shards [i].outbuf))
+        ShardLost (i);
+
+    /* don't leave shards that died as zombies */
+    for (int i = 0; i < iShards; i++)
+      if (shards [i].s == NO_SOCKET)
+        ReapShard (shards [i]);
+
+    FD_ZERO (&in_set);
+    FD_ZERO (&out_set);
+
+    FD_SET (iControl, &in_set);
+    FD_SET (iWebControl, &in_set);
+    iMaxdesc = UMAX (iControl, iWebControl);
+
+    int iLive = 0;
+    for (int i = 0; i < iShards; i++)
+      {
+      tShard & shard = shards [i];
+      if (shard.s == NO_SOCKET)
+        continue;
+      iLive++;
+      iMaxdesc = UMAX (iMaxdesc, shard.s);
+      FD_SET (shard.s, &in_set);
+      if (!shard.outbuf.empty ())
+        FD_SET (shard.s, &out_set);
+      }
+
+    /* nothing left to route for */
+    if (iLive == 0)
+      {
+      fprintf (stderr, "All shards have gone, router exiting\n");
+      break;
+      }
+
+    timeout.tv_sec = COMMS_WAIT_SEC;
+    timeout.tv_usec = COMMS_WAIT_USEC;
+
+    if (select (iMaxdesc + 1, &in_set, &out_set, NULL, &timeout) <= 0)
+      continue;		/* time limit expired, or interrupted by a signal */
+
+    if (FD_ISSET (iControl, &in_set))
+      RouteNewConnections (iControl, eTelnet, iNext);
+    if (FD_ISSET (iWebControl, &in_set))
+      RouteNewConnections (iWebControl, eWebSocketHandshake, iNext);
+
+    for (int i = 0; i < iShards; i++)
+      {
+      tShard & shard = shards [i];
+      if (shard.s == NO_SOCKET || !FD_ISSET (shard.s, &in_set))
+        continue;
+
+      bool bAlive = BusRead (shard.s, shard.inbuf);
+
+      int iType;
+      string body;
+      while (BusNextFrame (shard.inbuf, iType, body))
+        RouteFrame (i, iType, body);
+
+      if (!bAlive)
+        ShardLost (i);
+      }
+
+    } while (!bStopNow);
+
+}	/* end of RouterLoop */
+
+/* ask the shards to close down, and wait for them */
+
+void StopShards (void)
+{
+  for (int i = 0; i < iShards; i++)
+    if (shards [i].pid > 0)
+      kill (shards [i].pid, SIGTERM);
+
+  for (int i = 0; i < iShards; i++)
+    {
+    if (shards [i].pid > 0)
+      waitpid (shards [i].pid, NULL, 0);
+    if (shards [i].s != NO_SOCKET)
+      close (shards [i].s);
+    if (shards [i].handoff != NO_SOCKET)
+      close (shards [i].handoff);
+    }
+}	/* end of StopShards */
+
+/* Here when a signal is raised */
+
+void bailout (int sig)
+{
+  printf ("**** Terminated by player on signal %i ****\n\n", sig);
+  bStopNow = 1;
+}	/* end of bailout */
 
-  /* loop until all outstanding connections are accepted */
-  while (true)
-    {
-    s = accept ( iControl, (struct sockaddr *) &sa, &sa_len);
+/* Here on SIGHUP - reload the message catalogs when we next get the chance */
 
-    /* a bad socket probably means no more connections are outstanding */
-    if (s == NO_SOCKET)
-      {
+void reload (int sig)
+{
+  bReloadMessages = 1;
+}	/* end of reload */
 
-      /* blocking is OK - we have accepted all outstanding connections */
-      if ( errno == EWOULDBLOCK )
-        return;
+/* turn a message into one line of text for a message file, eg. newline becomes \n */
 
-      perror ("accept");
-      return;
+string EscapeMessage (const char * text)
+{
+  string escaped;
+  for ( ; *text; text++)
+    switch (*text)
+      {
+      case '\n': escaped += "\\n"; break;
+      case '\r': escaped += "\\r"; break;
+      case '\t': escaped += "\\t"; break;
+      case '\\': escaped += "\\\\"; break;
+      default:   escaped += *text; break;
       }
+  return escaped;
+}	/* end of EscapeMessage */
 
-    /* TODO: you might immediately close sockets if they are from an address
-      which is not acceptable (eg. spammers) */
+/* the reverse of EscapeMessage */
 
-   
-    /* here on successful accept - make sure socket doesn't block */
-    
-    /* make sure socket doesn't block */
-    if (fcntl (s, F_SETFL, FNDELAY) == -1)
+string UnescapeMessage (const string & line)
+{
+  string text;
+  for (string::size_type i = 0; i < line.length (); i++)
+    {
+    if (line [i] != '\\' || i + 1 == line.length ())
       {
-      perror ("fcntl on player socket");
-      return;
+      text += line [i];
+      continue;
       }
+    switch (line [++i])
+      {
+      case 'n': text += '\n'; break;
+      case 'r': text += '\r'; break;
+      case 't': text += '\t'; break;
+      default:  text += line [i]; break;
+      }
+    }
+  return text;
+}	/* end of UnescapeMessage */
 
-    tPlayer * p = new tPlayer;
-
-    p->s = s;
-    p->address = inet_ntoa ( sa.sin_addr);
-    p->port = ntohs (sa.sin_port);
-
-    playerlist.push_back (p);
-    
-    printf ("New player accepted on socket %i, from address %s, port %i\n",
-            s, str (p->address), p->port);
+/* "tinymudserver -d" - print the default messages, as a message file for -c */
 
-    Send (p, INITIAL_STRING);
-    Send (p, TELL_NAME);
-   
-    
-    } /* end of processing *all* new connections */
+int DumpMessages (void)
+{
+  printf ("# Tinymudserver %s messages - one per line, the message name then its text.\n", VERSION);
+  printf ("# Keep the %% codes the same as they are here, and in the same order.\n");
+  for (int i = 0; i < eMessageCount; i++)
+    printf ("%s %s\n", messagenames [i], str (EscapeMessage (defaultmessages [i])));
+  return 0;
+}	/* end of DumpMessages */
 
-  } /* end of ProcessNewConnection */
+/* "tinymudserver -c <message file> <catalog>" - make a catalog (see LoadCatalog) */
 
-void ProcessException (tPlayer * p)
+int CompileCatalog (const char * textfile, const char * catalogfile)
 {
-  fprintf (stderr, "Exception on socket %i\n", p->s);
+  string contents;
+  if (!ReadFile (textfile, contents))
+    {
+    perror (textfile);
+    return 1;
+    }
 
-  /* signals can cause exceptions, don't get too excited. :) */
-}	/* end of ProcessException */
+  vector<string> names;
+  vector<string> texts;
+  int iLine = 0;
+  int iErrors = 0;
 
-/* Here when there is outstanding data to be read for this player */
+  string::size_type iStart = 0;
+  while (iStart < contents.length ())
+    {
+    string::size_type iEnd = contents.find ('\n', iStart);
+    if (iEnd == string::npos)
+      iEnd = contents.length ();
+    string sLine (contents, iStart, iEnd - iStart);
+    iStart = iEnd + 1;
+    iLine++;
+
+    StripControl (sLine);
+    if (sLine.empty () || sLine [0] == '#')
+      continue;
+
+    string::size_type iSpace = sLine.find (' ');
+    string name (sLine, 0, iSpace);
+    string text = iSpace == string::npos ? "" : UnescapeMessage (sLine.substr (iSpace + 1));
+    int iMsg = FindMessage (name);
+
+    if (iMsg < 0)
+      {
+      fprintf (stderr, "%s line %i: unknown message %s\n", textfile, iLine, str (name));
+      iErrors++;
+      }
+    else if (FormatSignature (str (text)) != FormatSignature (defaultmessages [iMsg]))
+      {
+      fprintf (stderr, "%s line %i: %s must have the %% codes \"%s\"\n",
+               textfile, iLine, str (name), str (EscapeMessage (defaultmessages [iMsg])));
+      iErrors++;
+      }
+    else
+      {
+      names.push_back (name);
+      texts.push_back (text);
+      }
+    }
 
-void ProcessRead (tPlayer * p)
-{
-  int nRead;
-  static char buf [1000];
+  if (iErrors)
+    return 1;
 
-  nRead = read(p->s, buf, sizeof(buf) - 1 );
-  
-  if (nRead == -1)
+  /* header, then the offsets, then the strings themselves */
+  unsigned int iCount = names.size ();
+  string header = CATALOG_MAGIC;
+  header.append ((const char *) &iCount, sizeof iCount);
+
+  string strings;
+  unsigned int iBase = header.length () + iCount * 8;
+  for (unsigned int i = 0; i < iCount; i++)
     {
-    if (errno != EWOULDBLOCK)
-      perror ("read from player");
-    return;
+    unsigned int iOffsets [2];
+    iOffsets [0] = iBase + strings.length ();
+    strings.append (str (names [i]), names [i].length () + 1);
+    iOffsets [1] = iBase + strings.length ();
+    strings.append (str (texts [i]), texts [i].length () + 1);
+    header.append ((const char *) iOffsets, sizeof iOffsets);
     }
+  header += strings;
 
-  if (nRead == 0)
+  FILE * f = fopen (catalogfile, "wb");
+  if (!f ||
+      fwrite (header.data (), 1, header.length (), f) != header.length () ||
+      fclose (f) != 0)
     {
-    fprintf (stderr, "Connection %i closed\n", p->s);
-    DoQuit (p);		// tell other players he has gone
-    return;
+    perror (catalogfile);
+    return 1;
     }
 
-  buf[nRead] = 0;   /* make sure null-terminated */
+  printf ("Wrote %u messages to %s\n", iCount, catalogfile);
+  return 0;
+}	/* end of CompileCatalog */
 
-  p->inbuf += buf;		/* add to input buffer */
+/*---------------------------------------------- */
+/*  session replayer */
+/*---------------------------------------------- */
 
-  /* try to extract lines from the input buffer */
-  for ( ; ; )
-    {
-    string::size_type i = p->inbuf.find ('\n');
-    if (i == string::npos)
-      break;	/* no more at present */
+/* "tinymudserver -p <trace> [speed]" - play a recorded trace (see OpenTrace)
+   against a server on this machine, with the original timing divided by speed.
+   Start the server with a fresh world, as existing player records or different
+   tick timing will make the output differ from the recording. */
 
-    string sLine = p->inbuf.substr (0, i);	/* extract first line */
-    p->inbuf = p->inbuf.substr (i + 1, string::npos);	/* get rest of string */
+struct tReplayRecord
+  {
+  long long iTime;        /* microseconds from the start of the trace */
+  int iType;              /* eTraceConnect etc. */
+  long long iConnection;
+  long long iValue;
+  string line;
+  };
+
+struct tReplaySession
+  {
+  int s;                  /* socket, NO_SOCKET if not connected */
+  bool bSkipped;          /* not telnet, so not replayed */
+  long long iRecordedBytes;
+  long long iReplayedBytes;
+  list<pair<string, long long> > waiting;   /* commands sent, and when, awaiting output */
 
-    Trim (sLine);	/* get rid of leading, trailing spaces */
-    ProcessPlayerInput (sLine, p);  /* now, do something with it */
-        
-    }
-    
-}	/* end of ProcessRead */
+  tReplaySession () : s (NO_SOCKET), bSkipped (false),
+                      iRecordedBytes (-1), iReplayedBytes (0) {}
+  };
 
-/* Here when we can send stuff to the player. We are allowing for large
- volumes of output that might not be sent all at once, so whatever cannot
- go this time gets put into the list of outstanding strings for this player. */
+/* read a trace file into records, false if it can't be read */
 
-void ProcessWrite (tPlayer * p)
+bool LoadTrace (const char * name, vector<tReplayRecord> & records)
 {
-  /* we will loop attempting to write all in buffer, until write blocks */
-  while (p->s != NO_SOCKET && !p->outbuf.empty ())
+  string buf;
+  if (!ReadFile (name, buf))
     {
+    perror (name);
+    return false;
+    }
 
-    /* get first outstanding string, remove from list */
-    string outbuf = p->outbuf.front ();
-    p->outbuf.pop_front ();
-    int iLength = outbuf.length ();
-
-    /* send to player */
-    int nWrite = write (p->s, str (outbuf), iLength );
+  if (buf.compare (0, 4, TRACE_MAGIC) != 0)
+    {
+    fprintf (stderr, "%s is not a session trace\n", name);
+    return false;
+    }
 
-    /* check for bad write */
-    if (nWrite < 0)
+  string::size_type pos = 4;
+  long long iTime = 0;
+  while (pos < buf.length ())
+    {
+    tReplayRecord r;
+    unsigned long long iDelta, iConnection, iValue;
+    r.iType = (unsigned char) buf [pos++];
+    if (!GetVarint (buf, pos, iDelta) ||
+        !GetVarint (buf, pos, iConnection) ||
+        !GetVarint (buf, pos, iValue) ||
+        r.iType < eTraceConnect || r.iType > eTraceClose ||
+        ((r.iType == eTraceLogin || r.iType == eTraceInput) &&
+          iValue > buf.length () - pos))
       {
-      if (errno != EWOULDBLOCK )
-        perror ("send to player");	/* some other error? */
-
-      /* write would block - push back onto front of queue */
-      p->outbuf.push_front (outbuf);
-      return;
+      fprintf (stderr, "%s is damaged after %u records\n", name, (unsigned) records.size ());
+      return false;
       }
 
-    /* if partial write, put back on queue, and exit */
-    if (nWrite < iLength)
+    iTime += iDelta;
+    r.iTime = iTime;
+    r.iConnection = iConnection;
+    r.iValue = iValue;
+    if (r.iType == eTraceLogin || r.iType == eTraceInput)
       {
-      p->outbuf.push_front (&outbuf [nWrite]);
-      return;
-      } /* end of partial write */
+      r.line.assign (buf, pos, iValue);
+      pos += iValue;
+      }
+    records.push_back (r);
+    }
 
-    } /* end of having write loop */
+  return true;
+}	/* end of LoadTrace */
 
-}		/* end of ProcessWrite */
+/* connect to the server as a telnet client would */
 
-/* main processing loop */
+int ReplayConnect (void)
+{
+  int s = socket (AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    return NO_SOCKET;
 
-void MainLoop (void)
+  struct sockaddr_in sa;
+  memset (&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (PORT);
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (connect (s, (struct sockaddr *) &sa, sizeof sa) < 0)
+    {
+    close (s);
+    return NO_SOCKET;
+    }
+
+  int iOne = 1;
+  setsockopt (s, IPPROTO_TCP, TCP_NODELAY, (char *) &iOne, sizeof iOne);
+  return s;
+}	/* end of ReplayConnect */
+
+/* write all of a command, false if the server has gone */
+
+bool ReplaySend (const int s, const string & data)
 {
+  string::size_type iDone = 0;
+  while (iDone < data.length ())
+    {
+    int nWrite = write (s, data.data () + iDone, data.length () - iDone);
+    if (nWrite < 0 && errno == EINTR)
+      continue;
+    if (nWrite <= 0)
+      return false;
+    iDone += nWrite;
+    }
+  return true;
+}	/* end of ReplaySend */
 
-fd_set in_set;
-fd_set out_set;
-fd_set exc_set;
-int iMaxdesc;
+/* print latency figures for one kind of command, in milliseconds */
 
-struct timeval timeout;
-tPlayerListIterator listiter;
-  
-  /* loop processing input, output, events */
+void ReplayReport (const string & verb, vector<long long> & latencies)
+{
+  sort (latencies.begin (), latencies.end ());
+  long long iTotal = 0;
+  for (vector<long long>::const_iterator i = latencies.begin (); i != latencies.end (); ++i)
+    iTotal += *i;
+
+  size_t n = latencies.size ();
+  printf ("  %-12s %8u %9.2f %9.2f %9.2f %9.2f\n", str (verb), (unsigned) n,
+          iTotal / 1000.0 / n,
+          latencies [n / 2] / 1000.0,
+          latencies [min (n - 1, n * 99 / 100)] / 1000.0,
+          latencies [n - 1] / 1000.0);
+}	/* end of ReplayReport */
+
+int ReplayTrace (const char * name, const double fSpeed)
+{
+  vector<tReplayRecord> records;
+  if (!LoadTrace (name, records))
+    return 1;
 
-  do
+  if (fSpeed <= 0)
     {
+    fprintf (stderr, "Replay speed must be more than zero\n");
+    return 1;
+    }
 
-    /* We will go through this loop roughly every COMMS_WAIT_SEC/COMMS_WAIT_USEC
-      seconds (at present 0.5 seconds).
-      Thus, this is a good place to put periodic processing (eg. fights,
-      weather, random events etc.).
-      The example below just sends a message every MESSAGE_INTERVAL seconds.
-      */
-    
-    /* send new command if it is time */
-    if (time (NULL) > (tLastMessage + MESSAGE_INTERVAL))
+  signal (SIGPIPE, SIG_IGN);
+
+  map<long long, tReplaySession> sessions;
+  map<string, vector<long long> > latencies;   /* by command word */
+  int iLines = 0;
+  int iFailed = 0;
+
+  printf ("Replaying %u records from %s at %gx speed\n",
+          (unsigned) records.size (), name, fSpeed);
+
+  long long iStart = MonotonicMicroseconds ();
+  long long iEnd = 0;       /* when to give up waiting for output, once all is sent */
+  vector<tReplayRecord>::const_iterator next = records.begin ();
+
+  for (;;)
+    {
+    long long iNow = MonotonicMicroseconds ();
+
+    /* do everything that is due */
+    for ( ; next != records.end () && next->iTime / fSpeed <= iNow - iStart; ++next)
       {
-      SendToAll (NULL, TICK_MESSAGE);
-      tLastMessage = time (NULL);
+      tReplaySession & session = sessions [next->iConnection];
+      if (session.bSkipped)
+        continue;
+
+      switch (next->iType)
+        {
+        case eTraceConnect:
+          if (next->iValue != eTelnet)
+            session.bSkipped = true;
+          else if ((session.s = ReplayConnect ()) == NO_SOCKET)
+            {
+            perror ("connect");
+            iFailed++;
+            }
+          break;
+
+        case eTraceLogin:
+        case eTraceInput:
+          if (session.s == NO_SOCKET)
+            break;
+          if (!ReplaySend (session.s, next->line + "\n"))
+            {
+            iFailed++;
+            break;
+            }
+          iLines++;
+          if (next->iType == eTraceLogin)
+            session.waiting.push_back (make_pair (string ("(login)"), iNow));
+          else
+            {
+            string line = next->line;
+            string verb = GetWord (line);
+            session.waiting.push_back (make_pair (verb.empty () ? string ("(blank)") : verb, iNow));
+            }
+          break;
+
+        case eTraceClose:
+          /* stop sending, but keep reading until the server closes its end */
+          session.iRecordedBytes = next->iValue;
+          if (session.s != NO_SOCKET)
+            shutdown (session.s, SHUT_WR);
+          break;
+        } /* end of switch on record type */
       }
-  
-    /* delete players who have closed their comms - have to do it outside other loops to avoid */
-    /* access violations (iterating loops that have had items removed) */
-    for (listiter = playerlist.begin (); listiter != playerlist.end (); )
-      {
-      tPlayer * p = *listiter;
 
-      if (p->s == NO_SOCKET)
+    if (next == records.end () && iEnd == 0)
+      iEnd = iNow + REPLAY_GRACE_USEC;
+
+    /* wait for output, or until the next record is due */
+    fd_set in_set;
+    FD_ZERO (&in_set);
+    int iMax = -1;
+    for (map<long long, tReplaySession>::const_iterator i = sessions.begin ();
+         i != sessions.end (); ++i)
+      if (i->second.s != NO_SOCKET)
         {
-        delete p;
-        playerlist.erase (listiter);
-        listiter = playerlist.begin ();		/* list iteration is no longer valid */
+        FD_SET (i->second.s, &in_set);
+        iMax = max (iMax, i->second.s);
         }
-      else
-        listiter++;
-      }	/* end of looping through players */
-    
-    /* get ready for "select" function ... */
 
-    FD_ZERO (&in_set);
-    FD_ZERO (&out_set);
-    FD_ZERO (&exc_set);
+    long long iWait = iEnd ? iEnd - iNow
+                           : (long long) (next->iTime / fSpeed) - (iNow - iStart);
+    if (iWait < 0 || (iEnd && iMax < 0))
+      break;    /* waited long enough, or everyone has gone */
 
-    /* add our control socket */
-    FD_SET (iControl, &in_set);
-    iMaxdesc	= iControl;
+    struct timeval timeout;
+    timeout.tv_sec = iWait / 1000000;
+    timeout.tv_usec = iWait % 1000000;
 
-    /* loop through all connections, adding them to the descriptor set */
-    for (listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+    if (select (iMax + 1, &in_set, NULL, NULL, &timeout) < 0)
       {
-      tPlayer * p = *listiter;
+      if (errno == EINTR)
+        continue;
+      perror ("select");
+      break;
+      }
 
-      /* don't bother if connection is closed */
-      if (p->s != NO_SOCKET)
-        {
-        iMaxdesc = UMAX (iMaxdesc, p->s);
-        FD_SET( p->s, &in_set  );
-        FD_SET( p->s, &exc_set );
+    iNow = MonotonicMicroseconds ();
+    for (map<long long, tReplaySession>::iterator i = sessions.begin ();
+         i != sessions.end (); ++i)
+      {
+      tReplaySession & session = i->second;
+      if (session.s == NO_SOCKET || !FD_ISSET (session.s, &in_set))
+        continue;
 
-        /* we are only interested in writing to sockets we have something for */
-        if (!p->outbuf.empty ())
-          FD_SET( p->s, &out_set );
-        }	/* end of active player */
+      char buf [4096];
+      int nRead = read (session.s, buf, sizeof buf);
+      if (nRead <= 0)
+        {
+        close (session.s);
+        session.s = NO_SOCKET;
+        continue;
+        }
 
-      }	/* end of looping through players */
-    
-    timeout.tv_sec = COMMS_WAIT_SEC;
-    timeout.tv_usec = COMMS_WAIT_USEC;  /* time to wait before timing out */
+      /* the first output after a command is its response */
+      session.iReplayedBytes += nRead;
+      for (list<pair<string, long long> >::const_iterator w = session.waiting.begin ();
+           w != session.waiting.end (); ++w)
+        latencies [w->first].push_back (iNow - w->second);
+      session.waiting.clear ();
+      }
+    } /* end of replay loop */
 
-    if (select (iMaxdesc + 1, &in_set, &out_set, &exc_set, &timeout) == 0)
-      continue;		/* time  limit expired? - nothing to do this time */
+  /* report how it went */
 
-    /* New connection on control port? */
-    if (FD_ISSET (iControl, &in_set))
-      ProcessNewConnection ();
+  int iSessions = 0;
+  int iSkipped = 0;
+  int iDiffer = 0;
+  for (map<long long, tReplaySession>::iterator i = sessions.begin ();
+       i != sessions.end (); ++i)
+    {
+    tReplaySession & session = i->second;
+    if (session.s != NO_SOCKET)
+      close (session.s);
 
-    /* loop through all players */
-    for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
+    if (session.bSkipped)
       {
-      tPlayer * p = *listiter;
-       
-      /* handle exceptions */
-      if (p->s != NO_SOCKET && FD_ISSET (p->s, &exc_set))
-        ProcessException (p);
-
-      /* look for ones we can read from, provided they aren't closed */
-      if (p->s != NO_SOCKET && FD_ISSET (p->s, &in_set))
-        ProcessRead (p);
-
-      /* look for ones we can write to, provided they aren't closed */
-      if (p->s != NO_SOCKET && FD_ISSET (p->s, &out_set))
-        ProcessWrite (p);
- 
-      }   /* end of looping looking through all players */
+      iSkipped++;
+      continue;
+      }
 
-    }  while (!bStopNow); 	/* end of looping processing input */
+    iSessions++;
+    if (session.iReplayedBytes != session.iRecordedBytes)
+      {
+      iDiffer++;
+      if (session.iRecordedBytes < 0)
+        printf ("Connection %lld: was still open when recording stopped, replayed %lld bytes\n",
+                i->first, session.iReplayedBytes);
+      else
+        printf ("Connection %lld: recorded %lld bytes, replayed %lld bytes\n",
+                i->first, session.iRecordedBytes, session.iReplayedBytes);
+      }
+    }
 
-}		/* end of MainLoop */
+  printf ("Replayed %i connections (%i skipped as not telnet), %i lines in %.1f seconds\n",
+          iSessions, iSkipped, iLines, (MonotonicMicroseconds () - iStart) / 1000000.0);
+  printf ("%i connections had different output to the recording, %i sends failed\n",
+          iDiffer, iFailed);
 
-/* Here when a signal is raised */
+  if (!latencies.empty ())
+    {
+    printf ("Response times in milliseconds:\n");
+    printf ("  %-12s %8s %9s %9s %9s %9s\n", "command", "count", "mean", "p50", "p99", "max");
+    for (map<string, vector<long long> >::iterator i = latencies.begin ();
+         i != latencies.end (); ++i)
+      ReplayReport (i->first, i->second);
+    }
 
-void bailout (int sig)
-{
-  printf ("**** Terminated by player on signal %i ****\n\n", sig);
-  bStopNow = 1;
-}	/* end of bailout */
+  return iDiffer || iFailed ? 2 : 0;
+}	/* end of ReplayTrace */
 
 int main (int argc, char* argv[])
 {
+  int iShardCount = 1;
+  int iNpcCount = NPC_COUNT;
+  int iMegabytes = MEMORY_BUDGET / (1024 * 1024);
+  string tracefile;
+
+  if (argc == 2 && strcmp (argv [1], "-d") == 0)
+    return DumpMessages ();
+  else if (argc == 4 && strcmp (argv [1], "-c") == 0)
+    return CompileCatalog (argv [2], argv [3]);
+  else if ((argc == 3 || argc == 4) && strcmp (argv [1], "-p") == 0)
+    return ReplayTrace (argv [2], argc == 4 ? atof (argv [3]) : 1.0);
+
+  /* -s <count> runs that many shard processes behind a router,
+     -r <file> records the sessions */
+  for (int i = 1; i < argc; i++)
+    {
+    if (strcmp (argv [i], "-s") == 0 && i + 1 < argc)
+      iShardCount = atoi (argv [++i]);
+    else if (strcmp (argv [i], "-r") == 0 && i + 1 < argc)
+      tracefile = argv [++i];
+    else if (strcmp (argv [i], "-n") == 0 && i + 1 < argc)
+      iNpcCount = atoi (argv [++i]);
+    else if (strcmp (argv [i], "-m") == 0 && i + 1 < argc)
+      iMegabytes = atoi (argv [++i]);
+    else
+      {
+      iShardCount = 0;
+      break;
+      }
+    }
+
+  if (iShardCount < 1 || iShardCount > MAX_SHARDS ||
+      iNpcCount < 0 || iNpcCount > MAX_NPCS || iMegabytes < 1)
+    {
+    fprintf (stderr, "Usage: %s [-s shards] [-r trace] [-n creatures] [-m megabytes]\n"
+                     "         (shards is 1 to %i, creatures is 0 to %i)\n"
+                     "       %s -d                       (print default messages)\n"
+                     "       %s -c <messages> <catalog>  (make a message catalog)\n"
+                     "       %s -p <trace> [speed]       (replay recorded sessions)\n",
+             argv [0], MAX_SHARDS, MAX_NPCS, argv [0], argv [0], argv [0]);
+    return 1;
+    }
 
 	printf ("Tinymudserver version %s\n", VERSION);
-  printf ("Accepting connections from port %i\n", PORT);
+  printf ("Accepting connections from port %i (web browsers on port %i)\n", PORT, WEB_PORT);
 
   /* standard termination signals */
   signal (SIGINT,  bailout);
   signal (SIGTERM, bailout);
-  signal (SIGHUP,  bailout);
+
+  /* SIGHUP reloads the message catalogs */
+  signal (SIGHUP,  reload);
+
+  /* a player (or shard) going away part-way through a write is not fatal */
+  signal (SIGPIPE, SIG_IGN);
+
+  /* each process (eg. each shard) has this much */
+  iMemoryBudget = iMegabytes * 1024LL * 1024;
+
+  /* from the environment rather than the command line, where "ps" would show it */
+  const char * sAdmin = getenv (ADMIN_PASSWORD_ENV);
+  if (sAdmin)
+    sAdminPassword = sAdmin;
+  if (sAdminPassword.empty ())
+    printf ("%s is not set, so nobody can log in as %s\n", ADMIN_PASSWORD_ENV, ADMIN_NAME);
+
+  InitChannels ();
+  FindLanguage (DEFAULT_LANGUAGE, true);
 
   /* initialise listening socket, exit if we can't */
 
   if (InitComms ())
     return 1;
+
+  /* sharded mode - the router never gets to the main loop, the shards do */
+  if (iShardCount > 1)
+    {
+    if (StartShards (iShardCount))
+      {
+      StopShards ();
+      return 1;
+      }
+
+    if (iShard < 0)
+      {
+      printf ("Routing connections to %i shards\n", iShards);
+      RouterLoop ();
+      StopShards ();
+      CloseComms ();
+      return 0;
+      }
+    }
+  else if (RecoverWorld ())		/* shards would need a shared journal, so don't persist */
+    return 1;
+
+  /* shards share out the creatures */
+  InitNpcs (iNpcCount / iShardCount);
+  StartNpcWorkers ();
+
+  /* each shard records its own connections */
+  if (!tracefile.empty ())
+    {
+    if (iShard >= 0)
+      {
+      char suffix [20];
+      snprintf (suffix, sizeof suffix, ".%i", iShard);
+      tracefile += suffix;
+      }
+    if (!OpenTrace (tracefile))
+      return 1;
+    }
   
   /* loop processing player input and other events */
 
@@ -860,19 +4806,32 @@ int main (int argc, char* argv[])
 
   /* tell them we have shut down */
   
-  SendToAll (NULL, SHUTDOWN);
+  SendToLocal (NULL, M_SHUTDOWN);
 
   /* wrap up */
 
+  /* make sure the last journal records are on disk before the last output goes */
+  if (!JournalFlush ())
+    fprintf (stderr, "**** Some changes could not be saved to the journal\n");
+
   /* delete all players from list */
   for (tPlayerListIterator listiter = playerlist.begin (); listiter != playerlist.end (); listiter++)
     {
     tPlayer * p = *listiter;
 
     ProcessWrite (p);		/* force out closure message */
+    Trace (eTraceClose, p->iConnection, p->iBytesSent);
     delete p;
     }
 
+  StopNpcWorkers ();
+
+  /* let any snapshot finish */
+  TraceFlush ();
+  if (iSnapshotPid)
+    waitpid (iSnapshotPid, NULL, 0);
+  iSnapshotPid = 0;
+
   /* close listening port */
   CloseComms ();
 